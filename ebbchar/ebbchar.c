@@ -17,6 +17,7 @@
 #include <linux/fs.h>             // Header for the Linux file system support
 #include <asm/uaccess.h>          // Required for the copy to user function
 #include <linux/mutex.h>
+#include "lkm_pmu.h"              // Message counters for perf, counted while lkm_pmu is loaded
 #define  DEVICE_NAME "ebbchar"    ///< The device will appear at /dev/ebbchar using this value
 #define  CLASS_NAME  "ebb"        ///< The device class -- this is a character device driver
  
@@ -86,6 +87,7 @@ static int __init ebbchar_init(void){
    }
    printk(KERN_INFO "EBBChar: device class created correctly\n"); // Made it! device was initialized
    mutex_init(&ebbchar_mutex);	//initialize the mutex lock dynamically
+   lkm_pmu_attach();                         // Count messages if lkm_pmu is loaded, fine without it
    return 0;
 }
  
@@ -99,6 +101,7 @@ static void __exit ebbchar_exit(void){
    class_destroy(ebbcharClass);                             // remove the device class
    unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
    mutex_destroy(&ebbchar_mutex);			    //destroy the dynamically-allocated mutex
+   lkm_pmu_detach();                                        // let lkm_pmu unload again
    printk(KERN_INFO "EBBChar: Goodbye from the LKM!\n");
 }
  
@@ -132,6 +135,8 @@ static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *of
  
    if (error_count==0){            // if true then have success
       printk(KERN_INFO "EBBChar: Sent %d characters to the user\n", size_of_message);
+      lkm_pmu_add(LKM_PMU_EBB_MSGS, 1);
+      lkm_pmu_add(LKM_PMU_EBB_BYTES, size_of_message);
       return (size_of_message=0);  // clear the position to the start and return 0
    }
    else {
@@ -152,6 +157,8 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, lof
    sprintf(message, "%s(%d letters)", buffer, len);   // appending received string with its length
    size_of_message = strlen(message);                 // store the length of the stored message
    printk(KERN_INFO "EBBChar: Received %d characters from the user\n", len);
+   lkm_pmu_add(LKM_PMU_EBB_MSGS, 1);
+   lkm_pmu_add(LKM_PMU_EBB_BYTES, len);
    return len;
 }
  
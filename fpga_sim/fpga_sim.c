@@ -0,0 +1,422 @@
+#include <linux/module.h>
+#include <linux/platform_device.h> //Platform device library
+#include <linux/slab.h>
+#include <linux/hrtimer.h> //Shift register timing
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/irqdomain.h>
+#include <linux/irq_sim.h> //Software interrupt controller for the DONE interrupts
+#include <linux/math64.h>
+
+#include "fpga_spi_regs.h"
+#include "fpga_sim.h"
+
+/*Register level stand-ins for the FPGA IPs, so the drivers can be loaded and
+ *benchmarked without the board. Each model is registered as a platform device
+ *with the name its driver binds to and a struct fpga_sim_ops as platform_data
+ *instead of a register window. The SPI cores shift their TX FIFO into the RX
+ *FIFO (MOSI looped back to MISO) at the rate CLKDIV and WIDTH ask for and
+ *raise DONE through irq_sim. Don't load this next to the real device modules,
+ *the device names clash.*/
+
+#define DRIVER_NAME "fpga_sim"
+#define SIM_NUM_SPI 2 //platform_spi and fpga_spi
+
+static unsigned int fifo_depth = 64;
+module_param(fifo_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_depth, "Words per simulated FIFO");
+
+static unsigned int clk_hz = 50000000;
+module_param(clk_hz, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(clk_hz, "Input clock of the simulated SPI cores, SCLK = clk_hz / (2 * (CLKDIV + 1))");
+
+static unsigned int latency_ns = 1000;
+module_param(latency_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(latency_ns, "Delay from the first TXDATA write of a burst to the first word shifting");
+
+static bool use_irq = true;
+module_param(use_irq, bool, S_IRUGO);
+MODULE_PARM_DESC(use_irq, "Raise DONE through irq_sim (0 = no IRQ resource, drivers poll)");
+
+//Model of one SPI core, register semantics as in fpga_spi_regs.h
+struct sim_spi {
+	struct fpga_sim_ops ops;
+	raw_spinlock_t lock; //Register accesses come from any context, the timer is hardirq
+	struct hrtimer timer;
+	int irq; //Linux IRQ raised on DONE, 0 when there is none
+	u32 *tx, *rx; //FIFOs, fifo_depth entries each
+	u32 tx_head, tx_count, rx_head, rx_count;
+	u32 control, slave_sel, clkdiv, width, irq_status, irq_enable, dma_ctrl;
+	bool busy; //Shift register running
+	ktime_t next; //When the entry at the head of TX is done shifting
+	u64 entries, tx_overflows, rx_underflows;
+};
+
+//Model of the custom LEDs IP, a single register
+struct sim_leds {
+	struct fpga_sim_ops ops;
+	u32 value;
+	u64 writes;
+};
+
+static const char *const sim_spi_names[SIM_NUM_SPI] = { "platform_spi", "fpga_spi" };
+static struct sim_spi *sim_spi[SIM_NUM_SPI];
+static struct sim_leds sim_leds;
+static struct platform_device *sim_pdev[SIM_NUM_SPI + 1];
+static struct irq_domain *sim_domain;
+
+/* SPI core model is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+//Time to shift one FIFO entry: WIDTH + 1 bits, or a full 32 bit entry when packed
+static u64 sim_entry_ns(struct sim_spi *s){
+	u32 bits = s->width + 1;
+
+	if ((s->control & FPGA_SPI_CONTROL_PACK) && (s->width == 7 || s->width == 15))
+		bits = 32;
+	return div_u64((u64)bits * 2 * (s->clkdiv + 1) * NSEC_PER_SEC, READ_ONCE(clk_hz) ? : 1) ? : 1;
+}
+
+//Starts the shift register if it is idle and has work. Caller holds s->lock.
+static void sim_spi_kick(struct sim_spi *s){
+	if (s->busy || !s->tx_count || !(s->control & FPGA_SPI_CONTROL_ENABLE))
+		return;
+
+	s->busy = true;
+	s->next = ktime_add_ns(ktime_get(), READ_ONCE(latency_ns) + sim_entry_ns(s));
+	hrtimer_start(&s->timer, s->next, HRTIMER_MODE_ABS_HARD);
+}
+
+//Raises DONE when it is enabled. Caller holds s->lock.
+static void sim_spi_raise(struct sim_spi *s){
+	if (s->irq > 0 && (s->irq_status & s->irq_enable & FPGA_SPI_IRQ_DONE))
+		irq_set_irqchip_state(s->irq, IRQCHIP_STATE_PENDING, true);
+}
+
+/*Moves every entry whose shift time has passed from TX to RX. Like the real
+ *core it stalls while the RX FIFO is full.*/
+static enum hrtimer_restart sim_spi_timer(struct hrtimer *timer){
+	struct sim_spi *s = container_of(timer, struct sim_spi, timer);
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	u32 word, mask;
+
+	raw_spin_lock_irqsave(&s->lock, flags);
+	mask = (s->control & FPGA_SPI_CONTROL_PACK) ? ~0 : GENMASK(s->width, 0);
+	while (s->tx_count && ktime_compare(s->next, now) <= 0) {
+		if (s->rx_count == fifo_depth) {
+			s->next = ktime_add_ns(now, sim_entry_ns(s));
+			break;
+		}
+		word = s->tx[s->tx_head];
+		s->tx_head = (s->tx_head + 1) % fifo_depth;
+		s->tx_count--;
+		s->rx[(s->rx_head + s->rx_count) % fifo_depth] = word & mask;
+		s->rx_count++;
+		s->entries++;
+		s->next = ktime_add_ns(s->next, sim_entry_ns(s));
+	}
+
+	if (s->tx_count) {
+		hrtimer_set_expires(timer, s->next);
+	} else {
+		s->busy = false;
+		s->irq_status |= FPGA_SPI_IRQ_DONE;
+		sim_spi_raise(s);
+		ret = HRTIMER_NORESTART;
+	}
+	raw_spin_unlock_irqrestore(&s->lock, flags);
+
+	return ret;
+}
+
+static u32 sim_spi_readl(void *priv, u32 reg){
+	struct sim_spi *s = priv;
+	unsigned long flags;
+	u32 val = 0;
+
+	raw_spin_lock_irqsave(&s->lock, flags);
+	switch (reg) {
+	case FPGA_SPI_RXDATA:
+		if (!s->rx_count) {
+			s->rx_underflows++;
+			break;
+		}
+		val = s->rx[s->rx_head];
+		s->rx_head = (s->rx_head + 1) % fifo_depth;
+		s->rx_count--;
+		break;
+	case FPGA_SPI_STATUS:
+		if (!s->tx_count)
+			val |= FPGA_SPI_STATUS_TX_EMPTY;
+		if (s->tx_count == fifo_depth)
+			val |= FPGA_SPI_STATUS_TX_FULL;
+		if (!s->rx_count)
+			val |= FPGA_SPI_STATUS_RX_EMPTY;
+		if (s->rx_count == fifo_depth)
+			val |= FPGA_SPI_STATUS_RX_FULL;
+		if (s->busy)
+			val |= FPGA_SPI_STATUS_BUSY;
+		break;
+	case FPGA_SPI_CONTROL:
+		val = s->control;
+		break;
+	case FPGA_SPI_SLAVE_SEL:
+		val = s->slave_sel;
+		break;
+	case FPGA_SPI_CLKDIV:
+		val = s->clkdiv;
+		break;
+	case FPGA_SPI_WIDTH:
+		val = s->width;
+		break;
+	case FPGA_SPI_TXLEVEL:
+		val = s->tx_count;
+		break;
+	case FPGA_SPI_RXLEVEL:
+		val = s->rx_count;
+		break;
+	case FPGA_SPI_FIFO_DEPTH:
+		val = fifo_depth;
+		break;
+	case FPGA_SPI_IRQ_STATUS:
+		val = s->irq_status;
+		break;
+	case FPGA_SPI_IRQ_ENABLE:
+		val = s->irq_enable;
+		break;
+	case FPGA_SPI_DMA_CTRL:
+		val = s->dma_ctrl;
+		break;
+	}
+	raw_spin_unlock_irqrestore(&s->lock, flags);
+
+	return val;
+}
+
+static void sim_spi_writel(void *priv, u32 reg, u32 val){
+	struct sim_spi *s = priv;
+	unsigned long flags;
+
+	raw_spin_lock_irqsave(&s->lock, flags);
+	switch (reg) {
+	case FPGA_SPI_TXDATA:
+		if (s->tx_count == fifo_depth) {
+			s->tx_overflows++;
+			break;
+		}
+		s->tx[(s->tx_head + s->tx_count) % fifo_depth] = val;
+		s->tx_count++;
+		sim_spi_kick(s);
+		break;
+	case FPGA_SPI_CONTROL:
+		s->control = val;
+		//Disabling the core flushes both FIFOs
+		if (!(val & FPGA_SPI_CONTROL_ENABLE)) {
+			hrtimer_try_to_cancel(&s->timer);
+			s->busy = false;
+			s->tx_count = 0;
+			s->rx_count = 0;
+		}
+		sim_spi_kick(s);
+		break;
+	case FPGA_SPI_SLAVE_SEL:
+		s->slave_sel = val;
+		break;
+	case FPGA_SPI_CLKDIV:
+		s->clkdiv = min_t(u32, val, FPGA_SPI_CLKDIV_MAX);
+		break;
+	case FPGA_SPI_WIDTH:
+		s->width = val & 31;
+		break;
+	case FPGA_SPI_IRQ_STATUS:
+		s->irq_status &= ~val;
+		break;
+	case FPGA_SPI_IRQ_ENABLE:
+		s->irq_enable = val;
+		sim_spi_raise(s);
+		break;
+	case FPGA_SPI_DMA_CTRL:
+		s->dma_ctrl = val;
+		break;
+	}
+	raw_spin_unlock_irqrestore(&s->lock, flags);
+}
+
+static struct sim_spi *sim_spi_create(void){
+	struct sim_spi *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (s == NULL)
+		return NULL;
+	s->tx = kcalloc(fifo_depth, sizeof(u32), GFP_KERNEL);
+	s->rx = kcalloc(fifo_depth, sizeof(u32), GFP_KERNEL);
+	if (s->tx == NULL || s->rx == NULL) {
+		kfree(s->tx);
+		kfree(s->rx);
+		kfree(s);
+		return NULL;
+	}
+
+	raw_spin_lock_init(&s->lock);
+	hrtimer_init(&s->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_HARD);
+	s->timer.function = sim_spi_timer;
+	//Reset values of the IP
+	s->slave_sel = ~0;
+	s->width = 31;
+	//Fastest divider, fpga_spi and the /dev/spi stream never program CLKDIV
+	s->clkdiv = 0;
+	s->ops.readl = sim_spi_readl;
+	s->ops.writel = sim_spi_writel;
+	s->ops.priv = s;
+
+	return s;
+}
+
+static void sim_spi_destroy(struct sim_spi *s){
+	if (s == NULL)
+		return;
+	hrtimer_cancel(&s->timer);
+	kfree(s->tx);
+	kfree(s->rx);
+	kfree(s);
+}
+
+/* LED model is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static u32 sim_leds_readl(void *priv, u32 reg){
+	struct sim_leds *l = priv;
+
+	return reg == 0 ? READ_ONCE(l->value) : 0;
+}
+
+static void sim_leds_writel(void *priv, u32 reg, u32 val){
+	struct sim_leds *l = priv;
+
+	if (reg != 0)
+		return;
+	WRITE_ONCE(l->value, val & 0xFF);
+	l->writes++;
+}
+
+/* Device registration is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static struct platform_device *sim_register(const char *name, const struct fpga_sim_ops *ops, int irq){
+	struct resource res = DEFINE_RES_IRQ(irq);
+	struct platform_device_info info = {
+		.name = name,
+		.id = PLATFORM_DEVID_NONE,
+		.res = &res,
+		.num_res = irq > 0 ? 1 : 0,
+		.data = ops, //Copied, the drivers get their own struct fpga_sim_ops
+		.size_data = sizeof(*ops),
+	};
+
+	return platform_device_register_full(&info);
+}
+
+//Interrupts are optional, without CONFIG_IRQ_SIM the drivers simply poll
+static int sim_irq_create(unsigned int i){
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	int irq;
+
+	if (!use_irq || IS_ERR_OR_NULL(sim_domain))
+		return 0;
+	irq = irq_create_mapping(sim_domain, i);
+	return irq > 0 ? irq : 0;
+#else
+	return 0;
+#endif
+}
+
+static void sim_cleanup(void){
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(sim_pdev); i++)
+		if (!IS_ERR_OR_NULL(sim_pdev[i]))
+			platform_device_unregister(sim_pdev[i]);
+
+	for (i = 0; i < SIM_NUM_SPI; i++) {
+		if (sim_spi[i] == NULL)
+			continue;
+		pr_info("%s: %s shifted %llu entries, %llu TX overflows, %llu RX underflows\n",
+			DRIVER_NAME, sim_spi_names[i], sim_spi[i]->entries,
+			sim_spi[i]->tx_overflows, sim_spi[i]->rx_underflows);
+		if (sim_spi[i]->irq > 0)
+			irq_dispose_mapping(sim_spi[i]->irq);
+		sim_spi_destroy(sim_spi[i]);
+		sim_spi[i] = NULL;
+	}
+	pr_info("%s: LEDs written %llu times\n", DRIVER_NAME, sim_leds.writes);
+
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	if (!IS_ERR_OR_NULL(sim_domain))
+		irq_domain_remove_sim(sim_domain);
+#endif
+	sim_domain = NULL;
+}
+
+//Basic functions for insmod and rmmod userspace calls
+static int __init sim_init(void){
+	unsigned int i;
+	int ret;
+
+	pr_info("\n Welcome to the FPGA simulator...\n");
+	if (fifo_depth == 0)
+		return -EINVAL;
+
+#if IS_ENABLED(CONFIG_IRQ_SIM)
+	if (use_irq) {
+		sim_domain = irq_domain_create_sim(NULL, SIM_NUM_SPI);
+		if (IS_ERR(sim_domain))
+			pr_info("%s: no irq_sim domain (%ld), cores will be polled\n",
+				DRIVER_NAME, PTR_ERR(sim_domain));
+	}
+#endif
+
+	for (i = 0; i < SIM_NUM_SPI; i++) {
+		sim_spi[i] = sim_spi_create();
+		if (sim_spi[i] == NULL) {
+			ret = -ENOMEM;
+			goto bad_exit;
+		}
+		sim_spi[i]->irq = sim_irq_create(i);
+		sim_pdev[i] = sim_register(sim_spi_names[i], &sim_spi[i]->ops, sim_spi[i]->irq);
+		if (IS_ERR(sim_pdev[i])) {
+			ret = PTR_ERR(sim_pdev[i]);
+			goto bad_exit;
+		}
+	}
+
+	sim_leds.ops.readl = sim_leds_readl;
+	sim_leds.ops.writel = sim_leds_writel;
+	sim_leds.ops.priv = &sim_leds;
+	sim_pdev[SIM_NUM_SPI] = sim_register("Custom LEDs Driver", &sim_leds.ops, 0);
+	if (IS_ERR(sim_pdev[SIM_NUM_SPI])) {
+		ret = PTR_ERR(sim_pdev[SIM_NUM_SPI]);
+		goto bad_exit;
+	}
+
+	return 0;
+
+bad_exit:
+	sim_cleanup();
+	return ret;
+}
+
+static void __exit sim_exit(void){
+	pr_info("\n Unloading the FPGA simulator...\n");
+	sim_cleanup();
+}
+
+//Mandatory function calls - must be included in every KLM
+module_init(sim_init);
+module_exit(sim_exit);
+
+//Module information
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Brad Turcott");
+MODULE_DESCRIPTION("Simulated FPGA SPI cores and LEDs for running the drivers without the board.");
+MODULE_VERSION("1.0");
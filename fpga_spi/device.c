@@ -7,6 +7,11 @@
 #define RESOURCE1_END_ADDRESS 0xC000003F
 #define DEVICE_IRQNM 0x0
 
+//Linux IRQ number of the FPGA-to-HPS interrupt wired to the SPI core
+static int irq = DEVICE_IRQNM;
+module_param(irq, int, S_IRUGO);
+MODULE_PARM_DESC(irq, "Interrupt number of the SPI core (0 = none, drivers poll)");
+
 //Module information
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Brad Turcott");
@@ -29,21 +34,26 @@ static struct resource spi_resources[] = {
 static struct platform_device spi_device = {
 	.name = DRIVER_NAME,
 	.id = -1,
-	.num_resources = 1,
+	.num_resources = ARRAY_SIZE(spi_resources),
 	.resource = spi_resources,
 };
 
 //Basic functions for insmod and rmmod userspace calls
 static int __init spi_init(void){
 	pr_info("\n Welcome to the spi platform device...\n");
-	platform_device_register(&spi_device);
-	return 0;
+	//Only hand out the IRQ resource when an interrupt is actually wired up
+	if (irq > 0) {
+		spi_resources[1].start = irq;
+		spi_resources[1].end = irq;
+	} else {
+		spi_device.num_resources = 1;
+	}
+	return platform_device_register(&spi_device);
 }
 
-static int __exit spi_exit(void){
+static void __exit spi_exit(void){
 	pr_info("\n Unloading spi platform device...\n");
 	platform_device_unregister(&spi_device);
-	return 0;
 }
 
 //Mandatory function calls - must be included in every KLM
@@ -1,145 +1,2288 @@
 #include <linux/module.h> //Basic library for kernel modules
 #include <linux/platform_device.h> //Platform driver library
 #include <linux/fs.h> //File system library: needed for file ops
-//#include <linux/miscdevice.h> //Misc driver library
+#include <linux/cdev.h> //Character device registration
+#include <linux/device.h> //Device class support
 #include <linux/uaccess.h> //Required for copy to user function
 #include <linux/io.h> //needed for iowrite32 functionality
+#include <linux/interrupt.h> //Threaded IRQ for transfer completion
+#include <linux/iopoll.h> //Polling fallback when no IRQ is wired
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/slab.h>
+#include <linux/kfifo.h> //Per file completion ring
+#include <linux/kthread.h> //Dispatcher feeding queued transfers to the core
+#include <linux/poll.h>
+#include <linux/compat.h>
+#include <linux/hrtimer.h> //Periodic acquisition timer
+#include <linux/vmalloc.h> //Acquisition ring, mapped to userspace
+#include <linux/mm.h>
+#include <linux/property.h> //num-cs and stripe-* from the device tree
+#include <linux/completion.h>
+#include <linux/scatterlist.h> //Pinned user buffers for large transfers
+#include <linux/sizes.h>
+#include <linux/io_uring.h> //uring_cmd passthrough
+#include <linux/uio.h>
+#include <linux/llist.h> //Per CPU submission queues
+#include <linux/percpu.h>
+#include <linux/mempool.h> //Reserved request descriptors and bounce buffers
+#include <linux/uio_driver.h> //Optional export of the register window
+#include <linux/idr.h> //Instance numbers when several cores are bound
+#include <linux/debugfs.h> //Register access profile
+#include <linux/kobject.h> //Lifetime of a core that files still have open
+#include <linux/rcupdate.h>
+#include <linux/kref.h> //Acquisition ring shared with read() and mappings
+
+#include "fpga_spi_regs.h"
+#include "fpga_spi_ioctl.h"
+#include "fpga_sim.h"
+#include "reg_prof.h"
+#include "lkm_pmu.h"
 
 #define DRIVER_NAME "fpga_spi"
 #define CLASS_NAME "spi"
+#define FPGA_SPI_BUF_SIZE 4096 //Largest transfer moved by one write()
+#define FPGA_SPI_TIMEOUT_US 100000 //Upper bound for one FIFO burst to drain
+#define FPGA_SPI_PIN_MAX SZ_64M //Largest transfer moved straight from pinned user pages
+
+//Completion ring entries per open file, also the cap on transfers in flight per file
+static unsigned int cq_depth = 256;
+module_param(cq_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(cq_depth, "Completion ring entries per open file (power of two)");
+
+/*Request descriptors and bounce buffers come from slab caches shared by the
+ *cores, with this many of each set aside per core at probe, so submissions
+ *keep going when the page allocator can't keep up. The default covers short
+ *bursts at 8 KiB of bounce buffer each. Only a reserve of every transfer a
+ *core can have in flight, cq_depth per open file, rules out EAGAIN from
+ *FPGA_SPI_IOC_SUBMIT under memory pressure.*/
+static unsigned int pool_reserve = 32;
+module_param(pool_reserve, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_reserve, "Transfer descriptors and bounce buffers reserved per core");
+
+/*Hands the core to a userspace driver: the register window and the DONE
+ *interrupt go out through UIO and none of the device nodes below exist.*/
+static bool uio;
+module_param(uio, bool, S_IRUGO);
+MODULE_PARM_DESC(uio, "Export the registers and interrupt through UIO instead of /dev/fpga_spi");
+
+#define FPGA_SPI_MAX_STRIPES 8 //Striped logical devices, one minor each
+#define FPGA_SPI_STRIPE_MAX_MEMBERS 8
+#define FPGA_SPI_STRIPE_DEPTH 8 //Chunks one striped read() or write() queues per core
+
+static unsigned int stripe_chunk = FPGA_SPI_BUF_SIZE;
+module_param(stripe_chunk, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(stripe_chunk, "Bytes a striped device moves through one core before the next (4 to 4096)");
+
+#define FPGA_SPI_ACQ_MIN_PERIOD_NS 10000
+#define FPGA_SPI_ACQ_MAX_RECORDS 65536
+
+/*NAPI style interrupt handling: a DONE interrupt masks the source and the IRQ
+ *thread handles up to napi_budget latched completions before it unmasks
+ *again and returns.*/
+static unsigned int napi_budget = 64;
+module_param(napi_budget, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(napi_budget, "Completions handled per run of the IRQ thread");
+
+//Scale of the weighted fair virtual clock, one byte at weight 1 costs this much
+#define FPGA_SPI_WFQ_SCALE 1024
+#define FPGA_SPI_QOS_MAX_WEIGHT 1024
+
+static int majorNumber;
+static struct class* fpgaspiClass = NULL;
+static DEFINE_IDA(fpga_spi_ida);
+static struct dentry *fpga_spi_debugfs_root;
+static struct kmem_cache *fpga_spi_req_cache;
+static struct kmem_cache *fpga_spi_buf_cache; //TX and RX bounce buffers, FPGA_SPI_BUF_SIZE each
+
+struct fpga_spi;
+struct fpga_spi_file;
+
+/*Several cores grouped RAID-0 style behind /dev/fpga_stripe<group>. The node
+ *exists while every member is bound.*/
+struct fpga_spi_stripe
+{
+	struct mutex		lock; //Membership, and one striped read() or write() at a time
+	u32			count; //Members the group is made of
+	u32			present;
+	struct fpga_spi		*member[FPGA_SPI_STRIPE_MAX_MEMBERS]; //In stripe order
+	struct device		*dev;
+};
+
+static struct fpga_spi_stripe fpga_spi_stripes[FPGA_SPI_MAX_STRIPES];
+static dev_t stripe_devt;
+static struct cdev stripe_cdev;
+
+/*One chip select, exposed as its own device node with its own queue. The
+ *dispatcher serves deadline devices earliest deadline first and shares what
+ *is left between bulk devices in proportion to their weight.*/
+struct fpga_spi_cs
+{
+	struct fpga_spi		*spi;
+	u32			cs;
+	struct device		*dev;
+	struct list_head	sq; //Requests merged by the dispatcher, under spi->sq_lock
+	u32			policy; //FPGA_SPI_QOS_*
+	u32			weight;
+	u64			deadline_ns; //Relative to submission
+	u64			vtime; //Virtual finish time of the last bulk request served
+	u64			dispatched;
+	u64			deadline_misses;
+	u8			*rx_buf;
+	size_t			rx_len; //Bytes clocked in by the last write()
+};
+
+/*Acquisition ring, a header page followed by the records. Referenced by the
+ *engine and by every read() in progress and mapping of it, so a restart
+ *with another size can swap in a new ring while the old one is still used.*/
+struct fpga_spi_acq_buf
+{
+	struct kref		ref;
+	struct fpga_spi_acq_ring *ring;
+	struct fpga_spi_acq_record *records;
+	u32			head; //Producer index, ring->head is only a copy for the consumer
+	u32			mask; //Records in the ring minus one
+	size_t			bytes;
+};
+
+//State of the periodic acquisition engine, one per core
+struct fpga_spi_acq
+{
+	struct hrtimer		timer;
+	raw_spinlock_t		lock; //Shared by the timer and the primary IRQ handler
+	struct fpga_spi_file	*owner; //File holding the ring, NULL when there is none
+	bool			running; //Timer armed, the bus belongs to the engine
+	bool			busy; //A sample is on the wire
+	ktime_t			period;
+	u32			cs; //Chip select of the owner's device node
+	u32			nwords;
+	u32			tx[FPGA_SPI_ACQ_MAX_WORDS];
+	u32			seq; //Period counter
+	u32			cur_seq; //Period of the sample on the wire
+	u64			t_start; //When the sample on the wire was started
+	struct fpga_spi_acq_buf	*buf; //Set while there is an owner, swapped under lock
+	wait_queue_head_t	wait;
+	struct fpga_spi_acq_stats stats;
+};
+
+/*Outlives the platform device while files are open. Probe holds one
+ *reference, dropped by devm once the core is unbound, and the cdev holds one
+ *on behalf of the open files, so read(), close() and friends never find the
+ *pools or the queues gone. Unbinding sets dead and fails what comes after.*/
+struct fpga_spi
+{
+	struct kobject		kobj;
+	bool			dead; //Unbound, submissions fail with ENODEV
+	struct cdev		c_dev;
+	dev_t			devt;
+	struct device		*dev;
+	void __iomem		*mmio_base;
+	const struct fpga_sim_ops *sim; //Register model from fpga_sim instead of mmio_base
+	int			irq; //<= 0 when the core has to be polled
+	u32			fifo_depth; //Words per FIFO, read back from the IP
+	struct mutex		lock; //One transfer on the bus at a time
+	wait_queue_head_t	wait; //Woken by the IRQ thread when a burst drains
+	struct fpga_spi_cs	*cs;
+	u32			num_cs;
+	struct llist_head __percpu *submit; //Lockless per CPU queues, drained by the dispatcher
+	spinlock_t		sq_lock; //Protects every chip select's queue and QoS
+	u64			vtime; //Virtual start time of the bulk request on the bus
+	wait_queue_head_t	sq_wait;
+	struct task_struct	*dispatcher;
+	mempool_t		*req_pool;
+	mempool_t		*buf_pool;
+	struct fpga_spi_acq	acq;
+	struct uio_info		*uio; //Set in UIO mode, userspace owns the registers
+	int			id; //Instance number, 0 keeps the plain node names
+	struct fpga_spi_stripe	*stripe; //Group this core is a member of, if any
+	u32			stripe_index;
+	struct dentry		*debugfs;
+	struct reg_prof		prof; //Register access counts, built with REG_PROF=y
+};
+
+static const char *const fpga_spi_reg_names[REG_PROF_REGS] = FPGA_SPI_REG_NAMES;
+
+static inline u32 fpga_spi_readl(struct fpga_spi *spi, u32 reg)
+{
+	struct reg_prof_sample s = reg_prof_begin(&spi->prof);
+	u32 val;
+
+	if (unlikely(spi->sim))
+		val = spi->sim->readl(spi->sim->priv, reg);
+	else
+		val = ioread32(spi->mmio_base + reg);
+	reg_prof_end(&spi->prof, s, reg, REG_PROF_READ);
+	return val;
+}
+
+static inline void fpga_spi_writel(struct fpga_spi *spi, u32 reg, u32 val)
+{
+	struct reg_prof_sample s = reg_prof_begin(&spi->prof);
+
+	if (unlikely(spi->sim))
+		spi->sim->writel(spi->sim->priv, reg, val);
+	else
+		iowrite32(val, spi->mmio_base + reg);
+	reg_prof_end(&spi->prof, s, reg, REG_PROF_WRITE);
+}
+
+static bool fpga_spi_acq_poll(struct fpga_spi *spi);
+
+/*Primary handler. Masks DONE at the source and hands over to the poll loop,
+ *so the line needs no IRQF_ONESHOT and no further interrupts are taken while
+ *completions keep coming.*/
+static irqreturn_t fpga_spi_irq(int irq, void *dev_id)
+{
+	struct fpga_spi *spi = dev_id;
+
+	if (!(fpga_spi_readl(spi, FPGA_SPI_IRQ_STATUS) & FPGA_SPI_IRQ_DONE))
+		return IRQ_NONE;
+
+	lkm_pmu_add(LKM_PMU_SPI_IRQS, 1);
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, 0);
+	return IRQ_WAKE_THREAD;
+}
+
+/*Poll loop, run in the IRQ thread. DONE still latches in IRQ_STATUS while it
+ *is masked, so each latched DONE is one completion: the acquisition sample is
+ *moved from the RX FIFO into its ring and transfer waiters are woken. The
+ *loop never waits for the next one. It stops once IRQ_STATUS reads clear or
+ *napi_budget completions have been handled, then unmasks DONE. A DONE that
+ *latched meanwhile raises the interrupt again as soon as it is unmasked, so
+ *a busy core runs the thread once per budget and the tasks it woke get the
+ *CPU in between.*/
+static irqreturn_t fpga_spi_irq_thread(int irq, void *dev_id)
+{
+	struct fpga_spi *spi = dev_id;
+	unsigned int work = 0, budget = max(READ_ONCE(napi_budget), 1U);
+
+	while (work < budget &&
+	       (fpga_spi_readl(spi, FPGA_SPI_IRQ_STATUS) & FPGA_SPI_IRQ_DONE)) {
+		fpga_spi_writel(spi, FPGA_SPI_IRQ_STATUS, FPGA_SPI_IRQ_DONE);
+		fpga_spi_acq_poll(spi);
+		wake_up(&spi->wait);
+		work++;
+	}
+
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, FPGA_SPI_IRQ_DONE);
+	return IRQ_HANDLED;
+}
+
+//Sleeps until burst words have been clocked back into the RX FIFO
+static int fpga_spi_wait_burst(struct fpga_spi *spi, u32 burst)
+{
+	u32 level;
+
+	//Refilled only once the burst is back, so the TX FIFO has run dry by then
+	lkm_pmu_add(LKM_PMU_SPI_FIFO_DRAINS, 1);
+
+	if (spi->irq <= 0)
+		return read_poll_timeout(fpga_spi_readl, level, level >= burst, 0,
+					 FPGA_SPI_TIMEOUT_US, false, spi, FPGA_SPI_RXLEVEL);
+
+	if (!wait_event_timeout(spi->wait, fpga_spi_readl(spi, FPGA_SPI_RXLEVEL) >= burst,
+				usecs_to_jiffies(FPGA_SPI_TIMEOUT_US)))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+/*Full duplex transfer of nwords 32 bit words with chip select cs held low
+ *for the whole transfer. Caller holds spi->lock.*/
+static int fpga_spi_xfer(struct fpga_spi *spi, u32 cs, const u32 *tx, u32 *rx, u32 nwords)
+{
+	u32 i, burst;
+	int ret = 0;
+
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~BIT(cs));
+
+	while (nwords) {
+		burst = min(nwords, spi->fifo_depth);
+
+		for (i = 0; i < burst; i++)
+			fpga_spi_writel(spi, FPGA_SPI_TXDATA, tx[i]);
+
+		ret = fpga_spi_wait_burst(spi, burst);
+		if (ret) {
+			dev_err(spi->dev, "FIFO burst timed out\n");
+			break;
+		}
+
+		for (i = 0; i < burst; i++)
+			rx[i] = fpga_spi_readl(spi, FPGA_SPI_RXDATA);
+
+		tx += burst;
+		rx += burst;
+		nwords -= burst;
+	}
+
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~0);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------
+ *Zero copy transfers
+ *
+ *Transfers larger than FPGA_SPI_BUF_SIZE aren't bounced. The caller's pages
+ *are pinned, described by a scatterlist and the PIO loop feeds the FIFO
+ *straight from them, one kmap at a time. The pages are unpinned as soon as
+ *the transfer is off the bus. Buffers have to be 32 bit aligned so no word
+ *straddles a page.
+ *--------------------------------------------------------------------------*/
+struct fpga_spi_pin
+{
+	struct page		**pages; //NULL for a registered buffer, io_uring holds those pinned
+	unsigned int		npages;
+	struct sg_table		sgt; //sgl is NULL when there is no buffer
+	bool			write; //Device writes into these pages
+};
+
+static inline bool fpga_spi_can_pin(u64 uaddr, size_t len)
+{
+	return IS_ALIGNED(uaddr | len, sizeof(u32)) && len <= FPGA_SPI_PIN_MAX;
+}
+
+static int fpga_spi_pin(struct fpga_spi_pin *pin, u64 uaddr, u32 len, bool write)
+{
+	unsigned long offset = uaddr & ~PAGE_MASK;
+	int ret;
+
+	pin->npages = DIV_ROUND_UP(offset + len, PAGE_SIZE);
+	pin->write = write;
+	pin->pages = kvmalloc_array(pin->npages, sizeof(*pin->pages), GFP_KERNEL);
+	if (pin->pages == NULL)
+		return -ENOMEM;
+
+	ret = pin_user_pages_fast(uaddr, pin->npages, write ? FOLL_WRITE : 0, pin->pages);
+	if (ret != pin->npages) {
+		if (ret > 0)
+			unpin_user_pages(pin->pages, ret);
+		ret = ret < 0 ? ret : -EFAULT;
+		goto bad_pin;
+	}
+
+	ret = sg_alloc_table_from_pages(&pin->sgt, pin->pages, pin->npages, offset, len, GFP_KERNEL);
+	if (ret) {
+		unpin_user_pages(pin->pages, pin->npages);
+		goto bad_pin;
+	}
+
+	return 0;
+
+bad_pin:
+	kvfree(pin->pages);
+	pin->pages = NULL;
+	return ret;
+}
+
+/*Registered buffers of at most FPGA_SPI_PIN_MAX take the same path. io_uring
+ *keeps their pages pinned until the command completes, so the bvecs only
+ *have to be described by a scatterlist. No word may straddle two bvecs.*/
+static int fpga_spi_pin_bvec(struct fpga_spi_pin *pin, const struct iov_iter *iter, u32 len, gfp_t gfp)
+{
+	const struct bio_vec *bv = iter->bvec;
+	size_t skip = iter->iov_offset, left, n;
+	struct scatterlist *sg;
+	unsigned int nents = 0, i;
+	int ret;
+
+	if (len > FPGA_SPI_PIN_MAX || !iov_iter_is_bvec(iter) ||
+	    !iov_iter_is_aligned(iter, sizeof(u32) - 1, sizeof(u32) - 1))
+		return -EINVAL;
+
+	for (left = len; left; left -= n, skip = 0, bv++, nents++)
+		n = min(bv->bv_len - skip, left);
+
+	ret = sg_alloc_table(&pin->sgt, nents, gfp);
+	if (ret)
+		return ret;
+
+	bv = iter->bvec;
+	skip = iter->iov_offset;
+	left = len;
+	for_each_sgtable_sg(&pin->sgt, sg, i) {
+		n = min(bv->bv_len - skip, left);
+		sg_set_page(sg, bv->bv_page, n, bv->bv_offset + skip);
+		left -= n;
+		skip = 0;
+		bv++;
+	}
+
+	return 0;
+}
+
+static void fpga_spi_unpin(struct fpga_spi_pin *pin)
+{
+	sg_free_table(&pin->sgt);
+	if (pin->pages == NULL)
+		return;
+	if (pin->write)
+		unpin_user_pages_dirty_lock(pin->pages, pin->npages, true);
+	else
+		unpin_user_pages(pin->pages, pin->npages);
+	kvfree(pin->pages);
+	pin->pages = NULL;
+}
+
+//Next word of a scatterlist walk, pages get mapped one at a time
+static u32 *fpga_spi_sg_word(struct sg_mapping_iter *miter)
+{
+	u32 *word;
+
+	if (miter->consumed >= miter->length) {
+		if (!sg_miter_next(miter))
+			return NULL;
+		miter->consumed = 0;
+	}
+	word = miter->addr + miter->consumed;
+	miter->consumed += sizeof(u32);
+	return word;
+}
+
+/*fpga_spi_xfer for pinned buffers, either side may be NULL. Caller holds
+ *spi->lock.*/
+static int fpga_spi_xfer_sg(struct fpga_spi *spi, u32 cs, struct sg_table *tx, struct sg_table *rx,
+			    u32 nwords)
+{
+	struct sg_mapping_iter txm, rxm;
+	u32 i, burst, *word;
+	int ret = 0;
+
+	if (tx)
+		sg_miter_start(&txm, tx->sgl, tx->orig_nents, SG_MITER_FROM_SG);
+	if (rx)
+		sg_miter_start(&rxm, rx->sgl, rx->orig_nents, SG_MITER_TO_SG);
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~BIT(cs));
+
+	while (nwords) {
+		burst = min(nwords, spi->fifo_depth);
+
+		for (i = 0; i < burst; i++) {
+			word = tx ? fpga_spi_sg_word(&txm) : NULL;
+			fpga_spi_writel(spi, FPGA_SPI_TXDATA, word ? *word : 0);
+		}
+
+		ret = fpga_spi_wait_burst(spi, burst);
+		if (ret) {
+			dev_err(spi->dev, "FIFO burst timed out\n");
+			break;
+		}
+
+		for (i = 0; i < burst; i++) {
+			u32 val = fpga_spi_readl(spi, FPGA_SPI_RXDATA);
+
+			word = rx ? fpga_spi_sg_word(&rxm) : NULL;
+			if (word)
+				*word = val;
+		}
+		nwords -= burst;
+	}
+
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~0);
+	if (tx)
+		sg_miter_stop(&txm);
+	if (rx)
+		sg_miter_stop(&rxm);
+	return ret;
+}
+
+/*----------------------------------------------------------------------------
+ *Submission queues and bus scheduling
+ *
+ *write() and FPGA_SPI_IOC_SUBMIT copy TX data into a request and push it on
+ *a lockless list of the CPU they run on, so submitters on different cores
+ *never share a lock. A dispatcher kthread merges those lists into the queue
+ *of each request's chip select, picks the next request across all chip
+ *selects and feeds the core back to back. Submitted requests are posted to
+ *the completion ring of the file that queued them and read() on that file
+ *reaps completions in batches, copying RX data out in the reaper's own
+ *context. A write() simply waits for its request.
+ *
+ *Deadline devices always go first, earliest absolute deadline first. Bulk
+ *devices share the rest by start time fair queueing: each request advances
+ *its chip select's virtual time by len / weight and the backlogged chip
+ *select with the smallest virtual time is served next. Transfers are not
+ *preempted, so a deadline device waits for at most one bulk transfer of up
+ *to FPGA_SPI_BUF_SIZE bytes.
+ *
+ *Requests from one CPU, and every request of one FPGA_SPI_IOC_SUBMIT, keep
+ *their order. Merged requests are ordered by submission time, which also
+ *covers a submitter that migrated between two calls unless the dispatcher
+ *happened to drain the two CPUs' lists in between.
+ *--------------------------------------------------------------------------*/
+struct fpga_spi_req
+{
+	struct fpga_spi		*spi; //Owns the pools the request came from
+	struct llist_node	lnode; //On a per CPU submit list until merged
+	struct list_head	node;
+	struct fpga_spi_file	*owner;
+	struct fpga_spi_cs	*cs;
+	struct completion	*done; //Set for write(), which waits instead of reaping
+	u64			submitted; //ns, taken without any lock at submission
+	u64			deadline; //Absolute, ns, deadline devices only
+	bool			pinned; //Moves straight from/to the pins below, no tx/rx copies
+	struct fpga_spi_pin	tx_pin;
+	struct fpga_spi_pin	rx_pin;
+	u64			tag;
+	void __user		*rx_user; //Copied out at reap time, NULL to drop
+	struct io_uring_cmd	*ioucmd; //Completed through io_uring instead of the cq
+	struct iov_iter		rx_iter; //Registered buffer the RX data goes to
+	bool			fixed; //rx_iter is set up
+	u32			len;
+	int			result;
+	u32			*tx; //Bounce buffer from buf_pool, NULL when pinned
+	u32			*rx;
+};
+
+struct fpga_spi_file
+{
+	struct fpga_spi		*spi;
+	struct fpga_spi_cs	*cs; //Chip select of the device node this file opened
+	spinlock_t		lock; //Protects cq against the dispatcher
+	DECLARE_KFIFO_PTR(cq, struct fpga_spi_req *);
+	wait_queue_head_t	cq_wait;
+	atomic_t		inflight; //Submitted and not yet reaped, bounded by the cq size
+	atomic_t		pending; //Submitted and not yet posted to cq
+	bool			async; //read() reaps completions once anything was submitted
+};
+
+/*Both pools hand out from their slab cache first and only dip into the
+ *reserve when that fails. Submitters that must not sleep pass GFP_NOWAIT and
+ *get NULL once the reserve is gone too, write() waits for an element instead.*/
+static struct fpga_spi_req *fpga_spi_req_get(struct fpga_spi *spi, gfp_t gfp)
+{
+	struct fpga_spi_req *req;
+
+	req = mempool_alloc(spi->req_pool, gfp);
+	if (req == NULL)
+		return NULL;
+	memset(req, 0, sizeof(*req));
+	req->spi = spi;
+	return req;
+}
+
+static struct fpga_spi_req *fpga_spi_req_alloc(struct fpga_spi *spi, u32 len, gfp_t gfp)
+{
+	u32 bytes = round_up(len, sizeof(u32));
+	struct fpga_spi_req *req;
+
+	req = fpga_spi_req_get(spi, gfp);
+	if (req == NULL)
+		return NULL;
+	req->tx = mempool_alloc(spi->buf_pool, gfp);
+	if (req->tx == NULL) {
+		mempool_free(req, spi->req_pool);
+		return NULL;
+	}
+	//Recycled, the tail of the last word and a missing tx_buf have to clock out zeros
+	memset(req->tx, 0, bytes);
+	req->rx = req->tx + FPGA_SPI_BUF_SIZE / sizeof(u32);
+	req->len = len;
+	return req;
+}
+
+//Request for a large transfer, pins both user buffers (either may be 0)
+static struct fpga_spi_req *fpga_spi_req_alloc_pinned(struct fpga_spi *spi, u64 tx_buf, u64 rx_buf,
+						      u32 len, gfp_t gfp)
+{
+	struct fpga_spi_req *req;
+	int ret = 0;
+
+	req = fpga_spi_req_get(spi, gfp);
+	if (req == NULL)
+		return ERR_PTR(-ENOMEM);
+	req->len = len;
+	req->pinned = true;
+
+	if (tx_buf)
+		ret = fpga_spi_pin(&req->tx_pin, tx_buf, len, false);
+	if (!ret && rx_buf)
+		ret = fpga_spi_pin(&req->rx_pin, rx_buf, len, true);
+	if (ret) {
+		fpga_spi_unpin(&req->tx_pin);
+		mempool_free(req, spi->req_pool);
+		return ERR_PTR(ret);
+	}
+
+	return req;
+}
+
+static void fpga_spi_req_free(struct fpga_spi_req *req)
+{
+	struct fpga_spi *spi = req->spi;
+
+	fpga_spi_unpin(&req->tx_pin);
+	fpga_spi_unpin(&req->rx_pin);
+	if (req->tx)
+		mempool_free(req->tx, spi->buf_pool);
+	mempool_free(req, spi->req_pool);
+}
+
+static void fpga_spi_pools_destroy(struct fpga_spi *spi)
+{
+	mempool_destroy(spi->buf_pool);
+	mempool_destroy(spi->req_pool);
+}
+
+//Fills both reserves at probe, torn down with the last reference to the core
+static int fpga_spi_pools_init(struct fpga_spi *spi)
+{
+	unsigned int reserve = max(pool_reserve, 1U);
+
+	spi->req_pool = mempool_create_slab_pool(reserve, fpga_spi_req_cache);
+	spi->buf_pool = mempool_create_slab_pool(reserve, fpga_spi_buf_cache);
+	if (spi->req_pool == NULL || spi->buf_pool == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*----------------------------------------------------------------------------
+ *io_uring passthrough
+ *
+ *IORING_OP_URING_CMD with cmd_op FPGA_SPI_URING_CMD_XFER carries a struct
+ *fpga_spi_xfer in a 128 byte SQE. It is queued like a submitted transfer and
+ *completed from the submitter's task context, where the RX data is copied out
+ *before the CQE is posted. Registered buffers (IORING_URING_CMD_FIXED) never
+ *touch the page tables: up to FPGA_SPI_BUF_SIZE they are copied through
+ *their bvecs, above it the PIO loop works on the bvecs' pages directly.
+ *--------------------------------------------------------------------------*/
+struct fpga_spi_uring_pdu
+{
+	struct fpga_spi_req	*req;
+};
+
+static inline struct fpga_spi_uring_pdu *fpga_spi_uring_pdu(struct io_uring_cmd *ioucmd)
+{
+	return (struct fpga_spi_uring_pdu *)ioucmd->pdu;
+}
+
+//Runs in the submitter's task once the transfer is off the bus
+static void fpga_spi_uring_done(struct io_uring_cmd *ioucmd)
+{
+	struct fpga_spi_req *req = fpga_spi_uring_pdu(ioucmd)->req;
+	ssize_t ret = req->result;
+
+	if (ret > 0 && !req->pinned) {
+		if (req->fixed) {
+			if (copy_to_iter(req->rx, req->len, &req->rx_iter) != req->len)
+				ret = -EFAULT;
+		} else if (req->rx_user && copy_to_user(req->rx_user, req->rx, req->len)) {
+			ret = -EFAULT;
+		}
+	}
+	fpga_spi_req_free(req);
+	io_uring_cmd_done(ioucmd, ret, 0);
+}
+
+//Large transfer between registered buffers, zero copy like a pinned one
+static struct fpga_spi_req *fpga_spi_uring_req_fixed(struct fpga_spi *spi, struct io_uring_cmd *ioucmd,
+						     const struct fpga_spi_xfer *x, gfp_t gfp)
+{
+	struct fpga_spi_req *req;
+	struct iov_iter iter;
+	int ret = 0;
+
+	req = fpga_spi_req_get(spi, gfp);
+	if (req == NULL)
+		return ERR_PTR(-ENOMEM);
+	req->len = x->len;
+	req->pinned = true;
+
+	if (x->tx_buf) {
+		ret = io_uring_cmd_import_fixed(x->tx_buf, x->len, WRITE, &iter, ioucmd);
+		if (!ret)
+			ret = fpga_spi_pin_bvec(&req->tx_pin, &iter, x->len, gfp);
+	}
+	if (!ret && x->rx_buf) {
+		ret = io_uring_cmd_import_fixed(x->rx_buf, x->len, READ, &iter, ioucmd);
+		if (!ret)
+			ret = fpga_spi_pin_bvec(&req->rx_pin, &iter, x->len, gfp);
+	}
+	if (ret) {
+		fpga_spi_req_free(req);
+		return ERR_PTR(ret);
+	}
+	return req;
+}
+
+static struct fpga_spi_req *fpga_spi_uring_req(struct fpga_spi *spi, struct io_uring_cmd *ioucmd,
+					       const struct fpga_spi_xfer *x, unsigned int issue_flags)
+{
+	bool fixed = ioucmd->flags & IORING_URING_CMD_FIXED;
+	//Inline issue can't sleep, EAGAIN has io_uring retry from a worker that can
+	gfp_t gfp = issue_flags & IO_URING_F_NONBLOCK ? GFP_NOWAIT : GFP_KERNEL;
+	struct fpga_spi_req *req;
+	struct iov_iter iter;
+	int ret = 0;
+
+	//Large transfers go straight to the pages, pinning plain user memory first
+	if (x->len > FPGA_SPI_BUF_SIZE) {
+		if (fixed)
+			req = fpga_spi_uring_req_fixed(spi, ioucmd, x, gfp);
+		else if (!fpga_spi_can_pin(x->tx_buf | x->rx_buf, x->len))
+			return ERR_PTR(-EINVAL);
+		//Pinning can fault pages in and sleep, leave it to the worker
+		else if (issue_flags & IO_URING_F_NONBLOCK)
+			return ERR_PTR(-EAGAIN);
+		else
+			req = fpga_spi_req_alloc_pinned(spi, x->tx_buf, x->rx_buf, x->len, gfp);
+		if (req == ERR_PTR(-ENOMEM) && (issue_flags & IO_URING_F_NONBLOCK))
+			return ERR_PTR(-EAGAIN);
+		return req;
+	}
+
+	req = fpga_spi_req_alloc(spi, x->len, gfp);
+	if (req == NULL)
+		return ERR_PTR(issue_flags & IO_URING_F_NONBLOCK ? -EAGAIN : -ENOMEM);
+
+	if (fixed) {
+		if (x->tx_buf) {
+			ret = io_uring_cmd_import_fixed(x->tx_buf, x->len, WRITE, &iter, ioucmd);
+			if (!ret && copy_from_iter(req->tx, x->len, &iter) != x->len)
+				ret = -EFAULT;
+		}
+		if (!ret && x->rx_buf) {
+			ret = io_uring_cmd_import_fixed(x->rx_buf, x->len, READ, &req->rx_iter, ioucmd);
+			req->fixed = !ret;
+		}
+	} else {
+		if (x->tx_buf && copy_from_user(req->tx, u64_to_user_ptr(x->tx_buf), x->len))
+			ret = -EFAULT;
+		req->rx_user = u64_to_user_ptr(x->rx_buf);
+	}
+
+	if (ret) {
+		fpga_spi_req_free(req);
+		return ERR_PTR(ret);
+	}
+	return req;
+}
+
+//Hands a finished request back to its file and wakes any reaper
+static void fpga_spi_req_post(struct fpga_spi_req *req)
+{
+	struct fpga_spi_file *f = req->owner;
+
+	if (req->ioucmd) {
+		io_uring_cmd_complete_in_task(req->ioucmd, fpga_spi_uring_done);
+		return;
+	}
+
+	if (req->done) {
+		complete(req->done);
+		return;
+	}
+
+	//The lock also tells spi_close when we are done touching f
+	spin_lock(&f->lock);
+	kfifo_put(&f->cq, req); //Never full, inflight is capped at the cq size
+	atomic_dec(&f->pending);
+	wake_up_interruptible(&f->cq_wait);
+	spin_unlock(&f->lock);
+}
+
+//Takes the next request off the queues. Caller holds spi->sq_lock.
+static struct fpga_spi_req *fpga_spi_pick(struct fpga_spi *spi)
+{
+	struct fpga_spi_req *req, *edf = NULL;
+	struct fpga_spi_cs *cs, *wfq = NULL;
+	u32 i;
+
+	for (i = 0; i < spi->num_cs; i++) {
+		cs = &spi->cs[i];
+		req = list_first_entry_or_null(&cs->sq, struct fpga_spi_req, node);
+		if (req == NULL)
+			continue;
+		if (cs->policy == FPGA_SPI_QOS_DEADLINE) {
+			if (edf == NULL || req->deadline < edf->deadline)
+				edf = req;
+		} else if (wfq == NULL || cs->vtime < wfq->vtime) {
+			wfq = cs;
+		}
+	}
+
+	if (edf) {
+		req = edf;
+	} else if (wfq) {
+		req = list_first_entry(&wfq->sq, struct fpga_spi_req, node);
+		spi->vtime = wfq->vtime;
+		wfq->vtime += div_u64((u64)req->len * FPGA_SPI_WFQ_SCALE, wfq->weight);
+	} else {
+		return NULL;
+	}
+
+	list_del(&req->node);
+	req->cs->dispatched++;
+	return req;
+}
+
+static bool fpga_spi_submitted(struct fpga_spi *spi)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		if (!llist_empty(per_cpu_ptr(spi->submit, cpu)))
+			return true;
+	return false;
+}
+
+/*Moves everything on the per CPU lists onto the chip select queues. Only the
+ *dispatcher takes requests off the lists, so the submitters' only shared
+ *write is the cmpxchg on their own CPU's list head.*/
+static void fpga_spi_merge(struct fpga_spi *spi)
+{
+	struct fpga_spi_req *req, *tmp, *pos;
+	struct llist_node *first;
+	struct fpga_spi_cs *cs;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		first = llist_del_all(per_cpu_ptr(spi->submit, cpu));
+		if (first == NULL)
+			continue;
+
+		spin_lock(&spi->sq_lock);
+		llist_for_each_entry_safe(req, tmp, llist_reverse_order(first), lnode) {
+			cs = req->cs;
+			if (cs->policy == FPGA_SPI_QOS_DEADLINE)
+				req->deadline = req->submitted + cs->deadline_ns;
+			//A chip select coming back from idle doesn't get credit for the time it was away
+			else if (list_empty(&cs->sq))
+				cs->vtime = max(cs->vtime, spi->vtime);
+
+			//Almost always appends, only requests from another CPU can be newer
+			list_for_each_entry_reverse(pos, &cs->sq, node)
+				if (pos->submitted <= req->submitted)
+					break;
+			list_add(&req->node, &pos->node);
+		}
+		spin_unlock(&spi->sq_lock);
+	}
+}
+
+/*Fails everything still queued, on the per CPU lists or merged, back to its
+ *owner. Run by spi_remove once the dispatcher is gone, which may never have
+ *got to run at all if kthread_stop() came first.*/
+static void fpga_spi_drain(struct fpga_spi *spi)
+{
+	struct fpga_spi_req *req;
+	u32 i;
+
+	fpga_spi_merge(spi);
+	spin_lock(&spi->sq_lock);
+	for (i = 0; i < spi->num_cs; i++) {
+		while ((req = list_first_entry_or_null(&spi->cs[i].sq, struct fpga_spi_req, node))) {
+			list_del(&req->node);
+			req->result = -ESHUTDOWN;
+			fpga_spi_req_post(req);
+		}
+	}
+	spin_unlock(&spi->sq_lock);
+}
+
+static int fpga_spi_dispatch(void *data)
+{
+	struct fpga_spi *spi = data;
+	struct fpga_spi_req *req;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(spi->sq_wait,
+					 fpga_spi_submitted(spi) || kthread_should_stop());
+
+		//Drain everything queued before going back to sleep so the bus never idles
+		for (;;) {
+			fpga_spi_merge(spi);
+			spin_lock(&spi->sq_lock);
+			req = fpga_spi_pick(spi);
+			spin_unlock(&spi->sq_lock);
+			if (req == NULL)
+				break;
+
+			mutex_lock(&spi->lock);
+			if (spi->acq.running)
+				req->result = -EBUSY;
+			else if (req->pinned)
+				req->result = fpga_spi_xfer_sg(spi, req->cs->cs,
+							       req->tx_pin.sgt.sgl ? &req->tx_pin.sgt : NULL,
+							       req->rx_pin.sgt.sgl ? &req->rx_pin.sgt : NULL,
+							       req->len / sizeof(u32));
+			else
+				req->result = fpga_spi_xfer(spi, req->cs->cs, req->tx, req->rx,
+							    DIV_ROUND_UP(req->len, sizeof(u32)));
+			mutex_unlock(&spi->lock);
+			//Release the user's pages now rather than when the completion is reaped
+			fpga_spi_unpin(&req->tx_pin);
+			fpga_spi_unpin(&req->rx_pin);
+			if (req->result == 0) {
+				req->result = req->len;
+				lkm_pmu_add(LKM_PMU_SPI_XFERS, 1);
+				lkm_pmu_add(LKM_PMU_SPI_BYTES, req->len);
+			}
+			if (req->cs->policy == FPGA_SPI_QOS_DEADLINE && ktime_get_ns() > req->deadline) {
+				spin_lock(&spi->sq_lock);
+				req->cs->deadline_misses++;
+				spin_unlock(&spi->sq_lock);
+			}
+			fpga_spi_req_post(req);
+		}
+	}
+
+	return 0;
+}
+
+/*Hands a chain to the dispatcher. It is linked from last, the newest
+ *request, back to first, the oldest, as the list is a stack. Migrating halfway is harmless, any CPU's list takes any
+ *request. Only a submission that finds its list empty wakes the dispatcher,
+ *a non-empty list means a wakeup is already on its way.
+ *
+ *The dead check and the add share one RCU read section. spi_remove waits
+ *those out after setting dead, so nothing lands on a list once it has moved
+ *on to failing what is queued. On ENODEV the chain is still the caller's.*/
+static int fpga_spi_queue_batch(struct fpga_spi *spi, struct fpga_spi_req *first,
+				struct fpga_spi_req *last)
+{
+	int ret = 0;
+
+	rcu_read_lock();
+	if (READ_ONCE(spi->dead))
+		ret = -ENODEV;
+	else if (llist_add_batch(&last->lnode, &first->lnode, raw_cpu_ptr(spi->submit)))
+		wake_up_interruptible(&spi->sq_wait);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int fpga_spi_queue(struct fpga_spi_cs *cs, struct fpga_spi_req *req)
+{
+	req->cs = cs;
+	req->submitted = ktime_get_ns();
+	return fpga_spi_queue_batch(cs->spi, req, req);
+}
+
+static long fpga_spi_set_qos(struct fpga_spi_cs *cs, struct fpga_spi_qos __user *uqos)
+{
+	struct fpga_spi_qos qos;
+
+	if (copy_from_user(&qos, uqos, sizeof(qos)))
+		return -EFAULT;
+	if (qos.policy == FPGA_SPI_QOS_DEADLINE) {
+		if (qos.deadline_ns == 0)
+			return -EINVAL;
+	} else if (qos.policy == FPGA_SPI_QOS_BULK) {
+		if (qos.weight == 0 || qos.weight > FPGA_SPI_QOS_MAX_WEIGHT)
+			return -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+
+	spin_lock(&cs->spi->sq_lock);
+	//Requests already queued keep the ordering they were queued with
+	cs->policy = qos.policy;
+	if (qos.policy == FPGA_SPI_QOS_DEADLINE)
+		cs->deadline_ns = qos.deadline_ns;
+	else
+		cs->weight = qos.weight;
+	spin_unlock(&cs->spi->sq_lock);
+
+	return 0;
+}
+
+static long fpga_spi_get_qos(struct fpga_spi_cs *cs, struct fpga_spi_qos __user *uqos)
+{
+	struct fpga_spi_qos qos = {};
+
+	spin_lock(&cs->spi->sq_lock);
+	qos.policy = cs->policy;
+	qos.weight = cs->weight;
+	qos.deadline_ns = cs->deadline_ns;
+	qos.dispatched = cs->dispatched;
+	qos.deadline_misses = cs->deadline_misses;
+	spin_unlock(&cs->spi->sq_lock);
+
+	return copy_to_user(uqos, &qos, sizeof(qos)) ? -EFAULT : 0;
+}
+
+//Issue side of the passthrough, also runs from the SQPOLL thread
+static int spi_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct fpga_spi_file *f = ioucmd->file->private_data;
+	struct fpga_spi_req *req;
+	struct fpga_spi_xfer x;
+	int ret;
+
+	BUILD_BUG_ON(sizeof(struct fpga_spi_uring_pdu) > sizeof(ioucmd->pdu));
+
+	if (ioucmd->cmd_op != FPGA_SPI_URING_CMD_XFER)
+		return -ENOTTY;
+	if (!(issue_flags & IO_URING_F_SQE128))
+		return -EINVAL;
+
+	//The SQE sits in memory userspace can still write, work from one snapshot
+	memcpy(&x, ioucmd->cmd, sizeof(x));
+	if (x.len == 0)
+		return -EINVAL;
+
+	req = fpga_spi_uring_req(f->spi, ioucmd, &x, issue_flags);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+	req->owner = f;
+	req->tag = x.tag;
+	req->ioucmd = ioucmd;
+	fpga_spi_uring_pdu(ioucmd)->req = req;
+	ret = fpga_spi_queue(f->cs, req);
+	if (ret) {
+		fpga_spi_req_free(req);
+		return ret;
+	}
+
+	return -EIOCBQUEUED;
+}
+
+static long fpga_spi_submit(struct fpga_spi_file *f, struct fpga_spi_submit __user *usub)
+{
+	struct fpga_spi_xfer __user *uxfers;
+	struct fpga_spi_submit sub;
+	struct fpga_spi_xfer x;
+	struct fpga_spi_req *req, *first = NULL, *last = NULL;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&sub, usub, sizeof(sub)))
+		return -EFAULT;
+	uxfers = u64_to_user_ptr(sub.xfers);
+	f->async = true;
+
+	for (i = 0; i < sub.count; i++) {
+		if (copy_from_user(&x, &uxfers[i], sizeof(x))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (x.len == 0 || (x.len > FPGA_SPI_BUF_SIZE &&
+				   !fpga_spi_can_pin(x.tx_buf | x.rx_buf, x.len))) {
+			ret = -EINVAL;
+			break;
+		}
+
+		//Reserve a completion slot first so the dispatcher can always post
+		if (atomic_inc_return(&f->inflight) > kfifo_size(&f->cq)) {
+			atomic_dec(&f->inflight);
+			ret = -EAGAIN;
+			break;
+		}
+
+		if (x.len > FPGA_SPI_BUF_SIZE) {
+			req = fpga_spi_req_alloc_pinned(f->spi, x.tx_buf, x.rx_buf, x.len, GFP_NOWAIT);
+			if (IS_ERR(req)) {
+				atomic_dec(&f->inflight);
+				ret = PTR_ERR(req);
+				break;
+			}
+		} else {
+			//Out of reserve means everything is tied up in flight, come back after reaping
+			req = fpga_spi_req_alloc(f->spi, x.len, GFP_NOWAIT);
+			if (req == NULL) {
+				atomic_dec(&f->inflight);
+				ret = -EAGAIN;
+				break;
+			}
+			if (x.tx_buf && copy_from_user(req->tx, u64_to_user_ptr(x.tx_buf), x.len)) {
+				fpga_spi_req_free(req);
+				atomic_dec(&f->inflight);
+				ret = -EFAULT;
+				break;
+			}
+			req->rx_user = u64_to_user_ptr(x.rx_buf);
+		}
+		req->owner = f;
+		req->tag = x.tag;
+		req->cs = f->cs;
+		req->submitted = ktime_get_ns();
+		atomic_inc(&f->pending);
+
+		//Newest at the head, the whole batch goes onto one list in one go
+		req->lnode.next = last ? &last->lnode : NULL;
+		last = req;
+		if (first == NULL)
+			first = req;
+	}
+
+	//Unbound under us, none of the batch went out
+	if (first && fpga_spi_queue_batch(f->spi, first, last)) {
+		while (last) {
+			req = last;
+			last = req->lnode.next ? llist_entry(req->lnode.next, struct fpga_spi_req, lnode) : NULL;
+			fpga_spi_req_free(req);
+			atomic_dec(&f->pending);
+			atomic_dec(&f->inflight);
+		}
+		return -ENODEV;
+	}
+
+	return i ? i : ret;
+}
+
+//Fills buffer with as many completions as fit, blocking for the first unless O_NONBLOCK
+static ssize_t fpga_spi_reap(struct fpga_spi_file *f, struct file *file, char __user *buffer, size_t len)
+{
+	struct fpga_spi_cqe cqe;
+	struct fpga_spi_req *req;
+	size_t n = 0, max = len / sizeof(cqe);
+	int ret;
+
+	if (max == 0)
+		return -EINVAL;
+
+	if (kfifo_is_empty(&f->cq)) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		ret = wait_event_interruptible(f->cq_wait, !kfifo_is_empty(&f->cq));
+		if (ret)
+			return ret;
+	}
+
+	while (n < max) {
+		spin_lock(&f->lock);
+		ret = kfifo_get(&f->cq, &req);
+		spin_unlock(&f->lock);
+		if (!ret)
+			break;
+
+		cqe.tag = req->tag;
+		cqe.result = req->result;
+		cqe.flags = 0;
+		if (req->result > 0 && req->rx_user &&
+		    copy_to_user(req->rx_user, req->rx, req->len))
+			cqe.result = -EFAULT;
+		fpga_spi_req_free(req);
+		atomic_dec(&f->inflight);
+
+		if (copy_to_user(buffer + n * sizeof(cqe), &cqe, sizeof(cqe)))
+			return n ? n * sizeof(cqe) : -EFAULT;
+		n++;
+	}
+
+	return n * sizeof(cqe);
+}
+
+/*----------------------------------------------------------------------------
+ *Periodic acquisition engine
+ *
+ *An hrtimer in hard interrupt context starts the preset transaction every
+ *period, so sampling does not depend on userspace being scheduled. The
+ *received words are harvested by the interrupt poll loop, or by the next
+ *timer tick if the loop hasn't got to them, and appended to a vmalloc ring
+ *that the owning file can read() or mmap().
+ *--------------------------------------------------------------------------*/
+static void fpga_spi_acq_jitter(struct fpga_spi_acq *acq, u64 jitter)
+{
+	struct fpga_spi_acq_stats *st = &acq->stats;
+
+	if (jitter < st->jitter_min_ns)
+		st->jitter_min_ns = jitter;
+	if (jitter > st->jitter_max_ns)
+		st->jitter_max_ns = jitter;
+	st->jitter_sum_ns += jitter;
+	//Delays of 2^31 ns and up share the last bucket
+	st->jitter_hist[jitter ? min_t(u32, ilog2(jitter), ARRAY_SIZE(st->jitter_hist) - 1) : 0]++;
+}
+
+//Clocks the preset words out. Caller holds acq->lock.
+static void fpga_spi_acq_kick(struct fpga_spi *spi, ktime_t now)
+{
+	struct fpga_spi_acq *acq = &spi->acq;
+	u32 i;
+
+	acq->busy = true;
+	acq->t_start = ktime_to_ns(now);
+	acq->cur_seq = acq->seq;
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~BIT(acq->cs));
+	for (i = 0; i < acq->nwords; i++)
+		fpga_spi_writel(spi, FPGA_SPI_TXDATA, acq->tx[i]);
+}
+
+//Pulls a finished sample out of the RX FIFO into the ring. Caller holds acq->lock.
+static void fpga_spi_acq_harvest(struct fpga_spi *spi)
+{
+	struct fpga_spi_acq *acq = &spi->acq;
+	struct fpga_spi_acq_buf *buf = acq->buf;
+	struct fpga_spi_acq_ring *ring = buf->ring;
+	struct fpga_spi_acq_record *rec = NULL;
+	u32 head = buf->head, i, word;
+
+	/*tail is written by the consumer, possibly through the mmap, so it only
+	 *decides whether there is room. The slot comes from our own head and mask.*/
+	if (head - smp_load_acquire(&ring->tail) <= buf->mask) {
+		rec = &buf->records[head & buf->mask];
+		rec->timestamp_ns = acq->t_start;
+		rec->seq = acq->cur_seq;
+		rec->nwords = acq->nwords;
+	} else {
+		acq->stats.overruns++;
+	}
+
+	for (i = 0; i < acq->nwords; i++) {
+		word = fpga_spi_readl(spi, FPGA_SPI_RXDATA);
+		if (rec)
+			rec->data[i] = word;
+	}
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~0);
+	acq->busy = false;
+	lkm_pmu_add(LKM_PMU_SPI_XFERS, 1);
+	lkm_pmu_add(LKM_PMU_SPI_BYTES, acq->nwords * sizeof(u32));
+
+	if (rec) {
+		smp_store_release(&buf->head, head + 1);
+		smp_store_release(&ring->head, head + 1);
+		acq->stats.samples++;
+		wake_up_interruptible(&acq->wait);
+	}
+}
 
-static int majorNumber;
-static struct class* fpgaspiClass = NULL;
-static struct device* fpgaspiDevice = NULL;
+static enum hrtimer_restart fpga_spi_acq_timer(struct hrtimer *timer)
+{
+	struct fpga_spi *spi = container_of(timer, struct fpga_spi, acq.timer);
+	struct fpga_spi_acq *acq = &spi->acq;
+	ktime_t now = ktime_get();
+	u64 late;
+
+	raw_spin_lock(&acq->lock);
+	fpga_spi_acq_jitter(acq, ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer))));
+
+	//Collect a finished sample the poll loop hasn't got to, or any sample on polled cores
+	if (acq->busy &&
+	    fpga_spi_readl(spi, FPGA_SPI_RXLEVEL) >= acq->nwords)
+		fpga_spi_acq_harvest(spi);
+
+	if (acq->busy)
+		acq->stats.missed++;
+	else
+		fpga_spi_acq_kick(spi, now);
+
+	//Periods that passed entirely while we were late count as missed too
+	late = hrtimer_forward(timer, now, acq->period);
+	acq->seq += late;
+	if (late > 1)
+		acq->stats.missed += late - 1;
+	raw_spin_unlock(&acq->lock);
 
-struct fpga_spi 
+	return HRTIMER_RESTART;
+}
+
+//Called from the IRQ poll loop, true if a finished sample was harvested
+static bool fpga_spi_acq_poll(struct fpga_spi *spi)
 {
-	struct cdev		c_dev;
-	void __iomem		*mmio_base;
-	u32 			spi_value;
+	struct fpga_spi_acq *acq = &spi->acq;
+	bool harvested = false;
+
+	if (!READ_ONCE(acq->running))
+		return false;
+
+	raw_spin_lock_irq(&acq->lock);
+	if (acq->busy && fpga_spi_readl(spi, FPGA_SPI_RXLEVEL) >= acq->nwords) {
+		fpga_spi_acq_harvest(spi);
+		harvested = true;
+	}
+	raw_spin_unlock_irq(&acq->lock);
+
+	return harvested;
+}
+
+//True once the sample on the wire has been harvested or sits whole in the RX FIFO
+static bool fpga_spi_acq_settled(struct fpga_spi *spi)
+{
+	return !READ_ONCE(spi->acq.busy) ||
+	       fpga_spi_readl(spi, FPGA_SPI_RXLEVEL) >= spi->acq.nwords;
+}
+
+/*Stops the timer and lets the last transaction finish. Caller holds spi->lock.
+ *With the timer gone nothing starts another sample, so the wait for the last
+ *one sleeps with interrupts on and only the harvest takes acq->lock.*/
+static void fpga_spi_acq_stop(struct fpga_spi *spi)
+{
+	struct fpga_spi_acq *acq = &spi->acq;
+	bool settled;
+
+	if (!acq->running)
+		return;
+
+	hrtimer_cancel(&acq->timer);
+	read_poll_timeout(fpga_spi_acq_settled, settled, settled, 10, FPGA_SPI_TIMEOUT_US,
+			  false, spi);
+	raw_spin_lock_irq(&acq->lock);
+	if (acq->busy) {
+		if (fpga_spi_readl(spi, FPGA_SPI_RXLEVEL) >= acq->nwords)
+			fpga_spi_acq_harvest(spi);
+		acq->busy = false;
+		fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~0);
+	}
+	WRITE_ONCE(acq->running, false);
+	raw_spin_unlock_irq(&acq->lock);
+	wake_up_interruptible(&acq->wait);
+}
+
+static struct fpga_spi_acq_buf *fpga_spi_acq_buf_alloc(u32 records)
+{
+	struct fpga_spi_acq_buf *buf;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (buf == NULL)
+		return NULL;
+	buf->bytes = PAGE_SIZE + PAGE_ALIGN(records * sizeof(struct fpga_spi_acq_record));
+	buf->ring = vmalloc_user(buf->bytes);
+	if (buf->ring == NULL) {
+		kfree(buf);
+		return NULL;
+	}
+	kref_init(&buf->ref);
+	buf->records = (void *)buf->ring + PAGE_SIZE;
+	buf->mask = records - 1;
+	buf->ring->size = records;
+	buf->ring->record_offset = PAGE_SIZE;
+	return buf;
+}
+
+static void fpga_spi_acq_buf_free(struct kref *ref)
+{
+	struct fpga_spi_acq_buf *buf = container_of(ref, struct fpga_spi_acq_buf, ref);
+
+	vfree(buf->ring);
+	kfree(buf);
+}
+
+static void fpga_spi_acq_buf_put(struct fpga_spi_acq_buf *buf)
+{
+	if (buf)
+		kref_put(&buf->ref, fpga_spi_acq_buf_free);
+}
+
+//Takes a reference on the current ring, NULL when there is none
+static struct fpga_spi_acq_buf *fpga_spi_acq_buf_get(struct fpga_spi_acq *acq)
+{
+	struct fpga_spi_acq_buf *buf;
+
+	raw_spin_lock_irq(&acq->lock);
+	buf = acq->buf;
+	if (buf)
+		kref_get(&buf->ref);
+	raw_spin_unlock_irq(&acq->lock);
+	return buf;
+}
+
+//Installs buf as the engine's ring and returns the one it replaces
+static struct fpga_spi_acq_buf *fpga_spi_acq_buf_swap(struct fpga_spi_acq *acq,
+						      struct fpga_spi_acq_buf *buf)
+{
+	struct fpga_spi_acq_buf *old;
+
+	raw_spin_lock_irq(&acq->lock);
+	old = acq->buf;
+	acq->buf = buf;
+	raw_spin_unlock_irq(&acq->lock);
+	return old;
+}
+
+static long fpga_spi_acq_start(struct fpga_spi_file *f, struct fpga_spi_acq_config __user *ucfg)
+{
+	struct fpga_spi *spi = f->spi;
+	struct fpga_spi_acq *acq = &spi->acq;
+	struct fpga_spi_acq_config cfg;
+	struct fpga_spi_acq_buf *buf = NULL;
+	u32 records;
+	long ret = 0;
+
+	if (copy_from_user(&cfg, ucfg, sizeof(cfg)))
+		return -EFAULT;
+	if (cfg.period_ns < FPGA_SPI_ACQ_MIN_PERIOD_NS || cfg.nwords == 0 ||
+	    cfg.nwords > min_t(u32, FPGA_SPI_ACQ_MAX_WORDS, spi->fifo_depth) ||
+	    cfg.ring_records < 2 || cfg.ring_records > FPGA_SPI_ACQ_MAX_RECORDS)
+		return -EINVAL;
+	records = roundup_pow_of_two(cfg.ring_records);
+
+	mutex_lock(&spi->lock);
+	//spi_remove stops the engine under the lock after setting dead
+	if (READ_ONCE(spi->dead)) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if ((acq->owner && acq->owner != f) || acq->running) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	/*A restart with a different ring size gets a fresh ring. The old one is
+	 *only replaced once the new one exists, and lives on while it is still
+	 *mapped or being read.*/
+	if (acq->buf == NULL || acq->buf->mask != records - 1) {
+		buf = fpga_spi_acq_buf_alloc(records);
+		if (buf == NULL) {
+			//Same state as a fresh fd, owner never lingers without a ring
+			buf = fpga_spi_acq_buf_swap(acq, NULL);
+			acq->owner = NULL;
+			ret = -ENOMEM;
+			goto out;
+		}
+		buf = fpga_spi_acq_buf_swap(acq, buf);
+		//Readers still waiting on the old ring give up on it
+		wake_up_interruptible(&acq->wait);
+	}
+	acq->buf->head = 0;
+	acq->buf->ring->head = 0;
+	acq->buf->ring->tail = 0;
+
+	acq->owner = f;
+	acq->cs = f->cs->cs;
+	acq->period = ns_to_ktime(cfg.period_ns);
+	acq->nwords = cfg.nwords;
+	memcpy(acq->tx, cfg.tx, sizeof(acq->tx));
+	acq->seq = 0;
+	acq->busy = false;
+	memset(&acq->stats, 0, sizeof(acq->stats));
+	acq->stats.jitter_min_ns = U64_MAX;
+	WRITE_ONCE(acq->running, true);
+	hrtimer_start(&acq->timer, acq->period, HRTIMER_MODE_REL_HARD);
+out:
+	mutex_unlock(&spi->lock);
+	fpga_spi_acq_buf_put(buf);
+	return ret;
+}
+
+//Releases the ring when its owner goes away
+static void fpga_spi_acq_release(struct fpga_spi_file *f)
+{
+	struct fpga_spi *spi = f->spi;
+	struct fpga_spi_acq *acq = &spi->acq;
+	struct fpga_spi_acq_buf *buf = NULL;
+
+	mutex_lock(&spi->lock);
+	if (acq->owner == f) {
+		fpga_spi_acq_stop(spi);
+		buf = fpga_spi_acq_buf_swap(acq, NULL);
+		acq->owner = NULL;
+	}
+	mutex_unlock(&spi->lock);
+	fpga_spi_acq_buf_put(buf);
+}
+
+static long fpga_spi_acq_get_stats(struct fpga_spi *spi, struct fpga_spi_acq_stats __user *ustats)
+{
+	struct fpga_spi_acq_stats *st;
+	int ret = 0;
+
+	st = kmalloc(sizeof(*st), GFP_KERNEL);
+	if (st == NULL)
+		return -ENOMEM;
+	raw_spin_lock_irq(&spi->acq.lock);
+	*st = spi->acq.stats;
+	raw_spin_unlock_irq(&spi->acq.lock);
+	if (copy_to_user(ustats, st, sizeof(*st)))
+		ret = -EFAULT;
+	kfree(st);
+
+	return ret;
+}
+
+/*Copies whole records from the ring, blocking for the first while acquisition
+ *runs. Works on the ring current at entry, an ACQ_START on another thread
+ *that swaps it ends the wait.*/
+static ssize_t fpga_spi_acq_read(struct fpga_spi_acq *acq, struct file *file, char __user *buffer, size_t len)
+{
+	struct fpga_spi_acq_buf *buf;
+	size_t n = 0, max = len / sizeof(struct fpga_spi_acq_record);
+	ssize_t ret = 0;
+	u32 head, tail;
+
+	if (max == 0)
+		return -EINVAL;
+	buf = fpga_spi_acq_buf_get(acq);
+	if (buf == NULL)
+		return 0;
+
+	for (;;) {
+		head = smp_load_acquire(&buf->head);
+		tail = READ_ONCE(buf->ring->tail);
+		//A tail moved through the mmap can't reach further back than the ring holds
+		if (head - tail > buf->mask + 1)
+			tail = head - (buf->mask + 1);
+		if (head != tail || !READ_ONCE(acq->running) || READ_ONCE(acq->buf) != buf)
+			break;
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		ret = wait_event_interruptible(acq->wait, smp_load_acquire(&buf->head) != tail ||
+					       !READ_ONCE(acq->running) || READ_ONCE(acq->buf) != buf);
+		if (ret)
+			goto out;
+	}
+
+	while (n < max && tail != head) {
+		if (copy_to_user(buffer + n * sizeof(struct fpga_spi_acq_record),
+				 &buf->records[tail & buf->mask],
+				 sizeof(struct fpga_spi_acq_record))) {
+			if (n == 0)
+				ret = -EFAULT;
+			break;
+		}
+		tail++;
+		n++;
+	}
+	smp_store_release(&buf->ring->tail, tail);
+	if (n)
+		ret = n * sizeof(struct fpga_spi_acq_record);
+out:
+	fpga_spi_acq_buf_put(buf);
+	return ret;
+}
+
+static void fpga_spi_acq_vm_open(struct vm_area_struct *vma)
+{
+	struct fpga_spi_acq_buf *buf = vma->vm_private_data;
+
+	kref_get(&buf->ref);
+}
+
+static void fpga_spi_acq_vm_close(struct vm_area_struct *vma)
+{
+	fpga_spi_acq_buf_put(vma->vm_private_data);
+}
+
+//Every mapping holds the ring it maps, a resize can't pull it from under userspace
+static const struct vm_operations_struct fpga_spi_acq_vm_ops = {
+	.open = fpga_spi_acq_vm_open,
+	.close = fpga_spi_acq_vm_close,
 };
 
+static int spi_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fpga_spi_file *f = file->private_data;
+	struct fpga_spi *spi = f->spi;
+	struct fpga_spi_acq_buf *buf = NULL;
+	int ret = -EINVAL;
+
+	mutex_lock(&spi->lock);
+	if (spi->acq.owner == f)
+		buf = fpga_spi_acq_buf_get(&spi->acq);
+	mutex_unlock(&spi->lock);
+	if (buf == NULL)
+		return ret;
+
+	ret = remap_vmalloc_range(vma, buf->ring, vma->vm_pgoff);
+	if (ret) {
+		fpga_spi_acq_buf_put(buf);
+		return ret;
+	}
+	vma->vm_private_data = buf;
+	vma->vm_ops = &fpga_spi_acq_vm_ops;
+
+	return 0;
+}
+
+static __poll_t spi_poll(struct file *file, poll_table *wait)
+{
+	struct fpga_spi_file *f = file->private_data;
+	struct fpga_spi_acq *acq = &f->spi->acq;
+	__poll_t mask = 0;
+
+	if (READ_ONCE(acq->owner) == f) {
+		poll_wait(file, &acq->wait, wait);
+		raw_spin_lock_irq(&acq->lock);
+		if (acq->buf && smp_load_acquire(&acq->buf->head) != READ_ONCE(acq->buf->ring->tail))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		raw_spin_unlock_irq(&acq->lock);
+		return mask;
+	}
+
+	poll_wait(file, &f->cq_wait, wait);
+	if (!kfifo_is_empty(&f->cq))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (atomic_read(&f->inflight) < kfifo_size(&f->cq))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static long spi_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct fpga_spi_file *f = file->private_data;
+
+	switch (cmd) {
+	case FPGA_SPI_IOC_SUBMIT:
+		return fpga_spi_submit(f, (struct fpga_spi_submit __user *)arg);
+	case FPGA_SPI_IOC_ACQ_START:
+		return fpga_spi_acq_start(f, (struct fpga_spi_acq_config __user *)arg);
+	case FPGA_SPI_IOC_ACQ_STOP:
+		if (f->spi->acq.owner != f)
+			return -EPERM;
+		mutex_lock(&f->spi->lock);
+		fpga_spi_acq_stop(f->spi);
+		mutex_unlock(&f->spi->lock);
+		return 0;
+	case FPGA_SPI_IOC_ACQ_STATS:
+		return fpga_spi_acq_get_stats(f->spi, (struct fpga_spi_acq_stats __user *)arg);
+	case FPGA_SPI_IOC_SET_QOS:
+		return fpga_spi_set_qos(f->cs, (struct fpga_spi_qos __user *)arg);
+	case FPGA_SPI_IOC_GET_QOS:
+		return fpga_spi_get_qos(f->cs, (struct fpga_spi_qos __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static int spi_open(struct inode *inodep, struct file *file){
-	pr_info("%s has been opened",DRIVER_NAME);
+	struct fpga_spi *spi = container_of(inodep->i_cdev, struct fpga_spi, c_dev);
+	struct fpga_spi_file *f;
+	int ret;
+
+	//The cdev pins spi for as long as the file is open, see struct fpga_spi
+	if (READ_ONCE(spi->dead))
+		return -ENODEV;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (f == NULL)
+		return -ENOMEM;
+	ret = kfifo_alloc(&f->cq, cq_depth, GFP_KERNEL);
+	if (ret) {
+		kfree(f);
+		return ret;
+	}
+	f->spi = spi;
+	f->cs = &spi->cs[iminor(inodep) - MINOR(spi->devt)];
+	spin_lock_init(&f->lock);
+	init_waitqueue_head(&f->cq_wait);
+	atomic_set(&f->inflight, 0);
+	atomic_set(&f->pending, 0);
+
+	file->private_data = f;
+	pr_info("%s has been opened\n",DRIVER_NAME);
+	return 0;
 }
 
 static int spi_close(struct inode *inodep, struct file *file){
-	pr_info("%s has been closed",DRIVER_NAME);
-}
-
-/*
-static ssize_t spi_read(struct file *file, char *buffer, size_t len, loff_t *offset)
-{
-	struct fpga_spi *spi = container_of(file->private_data, struct fpga_spi, miscdev);
-	int	missing = 0;
-	
-	pr_info("%s file: read()\n", DRIVER_NAME);
-	pr_info("Buffer is: %d\n", sizeof(buffer));
-	pr_info("Spi value is: %p\n",spi->mmio_base);
-	pr_info("Size of is: %d\n", sizeof(spi->spi_value));
-	
-	missing = copy_to_user(buffer, spi->mmio_base, sizeof(spi->spi_value));
-	
-	if(missing != 0) {
-        	pr_info("Failed to return current led value to userspace\n");
-        	return -EFAULT; // Bad address error value. It's likely that "buffer" doesn't point to a good address
-    	}
+	struct fpga_spi_file *f = file->private_data;
+	struct fpga_spi *spi = f->spi;
+	struct fpga_spi_req *req, *tmp;
+
+	fpga_spi_acq_release(f);
+
+	//Pull our merged requests that haven't started, then wait out the rest
+	spin_lock(&spi->sq_lock);
+	list_for_each_entry_safe(req, tmp, &f->cs->sq, node) {
+		if (req->owner != f)
+			continue;
+		list_del(&req->node);
+		fpga_spi_req_free(req);
+		atomic_dec(&f->pending);
+	}
+	spin_unlock(&spi->sq_lock);
+	wait_event(f->cq_wait, atomic_read(&f->pending) == 0);
+	spin_lock(&f->lock);
+	spin_unlock(&f->lock);
+
+	while (kfifo_get(&f->cq, &req))
+		fpga_spi_req_free(req);
+	kfifo_free(&f->cq);
+	kfree(f);
 
+	pr_info("%s has been closed\n",DRIVER_NAME);
 	return 0;
 }
 
+/*Returns the bytes clocked in by the previous write(), completions once this
+ *file has used FPGA_SPI_IOC_SUBMIT, or acquisition records if it owns the ring*/
+static ssize_t spi_read(struct file *file, char __user *buffer, size_t len, loff_t *offset)
+{
+	struct fpga_spi_file *f = file->private_data;
+	struct fpga_spi *spi = f->spi;
+	struct fpga_spi_cs *cs = f->cs;
+	ssize_t ret;
+
+	if (READ_ONCE(spi->acq.owner) == f)
+		return fpga_spi_acq_read(&spi->acq, file, buffer, len);
+	if (f->async)
+		return fpga_spi_reap(f, file, buffer, len);
+
+	mutex_lock(&spi->lock);
+	len = min(len, cs->rx_len);
+	if (copy_to_user(buffer, cs->rx_buf, len)) {
+		pr_info("Failed to return received data to userspace\n");
+		ret = -EFAULT; // Bad address error value. It's likely that "buffer" doesn't point to a good address
+	} else {
+		cs->rx_len = 0;
+		ret = len;
+	}
+	mutex_unlock(&spi->lock);
 
+	return ret;
+}
 
+/*Clocks up to FPGA_SPI_BUF_SIZE bytes out as 32 bit words, zero padding the
+ *last word. Short writes are reported so userspace loops for the rest. Bigger
+ *32 bit aligned buffers go out whole and zero copy, but can't be read back.
+ *The transfer goes through the scheduler like any queued request.*/
 static ssize_t spi_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
 {
-	struct fpga_spi *spi = container_of(file->private_data, struct fpga_spi, miscdev);
-	//struct fpga_spi *spi;
-	int	missing;
-	//spi = file->private_data;
-	//spi->spi_value = devm_kmalloc(32, GFP_KERNEL); 
-	
-	pr_info("%s file: write()\n", DRIVER_NAME);
-	pr_info("Buffer is: %d\n", sizeof(buffer));
-	pr_info("Spi value is: %p\n",&spi->spi_value);
-	pr_info("Size of is: %d\n", sizeof(spi->spi_value));
-	missing = copy_from_user(spi->mmio_base, buffer, sizeof(spi->spi_value));
-	
-	//pr_info("Copy from user complete.\n");
-	//iowrite32(spi->spi_value, spi->mmio_base);
-	//pr_info("iowrite32 complete.\n");
-	return len;
-}
-*/
+	struct fpga_spi_file *f = file->private_data;
+	struct fpga_spi *spi = f->spi;
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct fpga_spi_req *req;
+	int ret;
+
+	if (len == 0)
+		return 0;
+
+	//Large aligned images go out from the caller's pages, what comes back is dropped
+	if (len > FPGA_SPI_BUF_SIZE && fpga_spi_can_pin((unsigned long)buffer, len)) {
+		req = fpga_spi_req_alloc_pinned(spi, (unsigned long)buffer, 0, len, GFP_KERNEL);
+		if (IS_ERR(req))
+			return PTR_ERR(req);
+	} else {
+		len = min_t(size_t, len, FPGA_SPI_BUF_SIZE);
+		req = fpga_spi_req_alloc(spi, len, GFP_KERNEL);
+		if (req == NULL)
+			return -ENOMEM;
+		if (copy_from_user(req->tx, buffer, len)) {
+			fpga_spi_req_free(req);
+			return -EFAULT;
+		}
+	}
+	req->owner = f;
+	req->done = &done;
+
+	//Bounded by the FIFO timeouts, and unbinding fails whatever is still queued
+	ret = fpga_spi_queue(f->cs, req);
+	if (ret) {
+		fpga_spi_req_free(req);
+		return ret;
+	}
+	wait_for_completion(&done);
+
+	ret = req->result;
+	mutex_lock(&spi->lock);
+	if (ret > 0 && !req->pinned)
+		memcpy(f->cs->rx_buf, req->rx, len);
+	f->cs->rx_len = ret > 0 && !req->pinned ? len : 0;
+	mutex_unlock(&spi->lock);
+	fpga_spi_req_free(req);
+
+	return ret;
+}
+
 //Data structure to define file operations
 static const struct file_operations fops = {
 	.owner = THIS_MODULE,
-	//.read = spi_read,
-	//.write = spi_write,
+	.read = spi_read,
+	.write = spi_write,
+	.poll = spi_poll,
+	.mmap = spi_mmap,
+	.uring_cmd = spi_uring_cmd,
+	.unlocked_ioctl = spi_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 	.open = spi_open,
 	.release = spi_close,
 };
 
+/*----------------------------------------------------------------------------
+ *Striping
+ *
+ *Cores whose nodes carry stripe-group, stripe-index and stripe-count are
+ *combined into /dev/fpga_stripe<group>. A read() or write() on it is cut into
+ *stripe_chunk sized pieces that go round robin to the members' first chip
+ *select, member stripe-index taking chunk n when n % stripe-count equals it.
+ *Every chunk is queued before the first is waited for, so the cores run in
+ *parallel, and the data is put back together in order. write() clocks the
+ *buffer out and drops what comes back, read() clocks out zeros and returns
+ *what comes in. Like write() on a core, one call moves a bounded amount,
+ *FPGA_SPI_STRIPE_DEPTH chunks per member, and reports short counts.
+ *--------------------------------------------------------------------------*/
+static int fpga_spi_stripe_join(struct fpga_spi *spi)
+{
+	struct fpga_spi_stripe *st;
+	u32 group, index, count;
+	int ret = 0;
+
+	if (device_property_read_u32(spi->dev, "stripe-group", &group))
+		return 0;
+	if (device_property_read_u32(spi->dev, "stripe-index", &index) ||
+	    device_property_read_u32(spi->dev, "stripe-count", &count) ||
+	    group >= FPGA_SPI_MAX_STRIPES || count == 0 ||
+	    count > FPGA_SPI_STRIPE_MAX_MEMBERS || index >= count) {
+		pr_err("%s: bad stripe-group/index/count\n", DRIVER_NAME);
+		return -EINVAL;
+	}
+
+	st = &fpga_spi_stripes[group];
+	mutex_lock(&st->lock);
+	if (st->present && st->count != count) {
+		pr_err("%s: stripe %u members disagree on stripe-count\n", DRIVER_NAME, group);
+		ret = -EINVAL;
+	} else if (st->member[index]) {
+		pr_err("%s: stripe %u index %u taken twice\n", DRIVER_NAME, group, index);
+		ret = -EBUSY;
+	}
+	if (ret)
+		goto out;
+
+	st->count = count;
+	st->member[index] = spi;
+	st->present++;
+	spi->stripe = st;
+	spi->stripe_index = index;
+
+	//The last member to show up brings the logical device to life
+	if (st->present == st->count) {
+		st->dev = device_create(fpgaspiClass, NULL, MKDEV(MAJOR(stripe_devt), group), NULL,
+					"fpga_stripe%u", group);
+		if (IS_ERR(st->dev)) {
+			ret = PTR_ERR(st->dev);
+			st->dev = NULL;
+			st->member[index] = NULL;
+			st->present--;
+			spi->stripe = NULL;
+		}
+	}
+out:
+	mutex_unlock(&st->lock);
+	return ret;
+}
+
+//Waits out a striped transfer in progress, then breaks the group up
+static void fpga_spi_stripe_leave(struct fpga_spi *spi)
+{
+	struct fpga_spi_stripe *st = spi->stripe;
+
+	if (st == NULL)
+		return;
+
+	mutex_lock(&st->lock);
+	if (st->dev) {
+		device_destroy(fpgaspiClass, st->dev->devt);
+		st->dev = NULL;
+	}
+	st->member[spi->stripe_index] = NULL;
+	st->present--;
+	mutex_unlock(&st->lock);
+	spi->stripe = NULL;
+}
+
+static ssize_t fpga_spi_stripe_rw(struct fpga_spi_stripe *st, char __user *buffer, size_t len, bool write)
+{
+	struct fpga_spi_req *reqs[FPGA_SPI_STRIPE_MAX_MEMBERS * FPGA_SPI_STRIPE_DEPTH];
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct fpga_spi_req *req;
+	struct fpga_spi *spi;
+	u32 chunk = clamp_t(u32, round_down(READ_ONCE(stripe_chunk), sizeof(u32)), sizeof(u32),
+			    FPGA_SPI_BUF_SIZE);
+	u32 k, n, nchunks, queued = 0;
+	ssize_t ret = 0;
+	size_t moved = 0, off;
+
+	if (len == 0)
+		return 0;
+
+	mutex_lock(&st->lock);
+	if (st->dev == NULL) {
+		mutex_unlock(&st->lock);
+		return -ENODEV;
+	}
+
+	nchunks = min_t(size_t, DIV_ROUND_UP(len, chunk), st->count * FPGA_SPI_STRIPE_DEPTH);
+	for (k = 0; k < nchunks; k++) {
+		off = (size_t)k * chunk;
+		n = min_t(size_t, chunk, len - off);
+		spi = st->member[k % st->count];
+
+		req = fpga_spi_req_alloc(spi, n, GFP_KERNEL);
+		if (req == NULL) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (write && copy_from_user(req->tx, buffer + off, n)) {
+			fpga_spi_req_free(req);
+			ret = -EFAULT;
+			break;
+		}
+		//Each post completes done once, it is waited for once per chunk below
+		req->done = &done;
+		ret = fpga_spi_queue(&spi->cs[0], req);
+		if (ret) {
+			fpga_spi_req_free(req);
+			break;
+		}
+		reqs[queued++] = req;
+	}
+
+	for (k = 0; k < queued; k++)
+		wait_for_completion(&done);
+
+	//Hand back the longest run of chunks that all made it, in order
+	for (k = 0; k < queued; k++) {
+		req = reqs[k];
+		if (ret == 0 && req->result < 0)
+			ret = req->result;
+		if (ret == 0 && !write && copy_to_user(buffer + moved, req->rx, req->len))
+			ret = -EFAULT;
+		if (ret == 0)
+			moved += req->len;
+		fpga_spi_req_free(req);
+	}
+	mutex_unlock(&st->lock);
+
+	return moved ? moved : ret;
+}
+
+static int stripe_open(struct inode *inodep, struct file *file)
+{
+	struct fpga_spi_stripe *st = &fpga_spi_stripes[iminor(inodep) - MINOR(stripe_devt)];
+	int ret = 0;
+
+	mutex_lock(&st->lock);
+	if (st->dev == NULL)
+		ret = -ENODEV;
+	mutex_unlock(&st->lock);
+
+	file->private_data = st;
+	return ret;
+}
+
+static ssize_t stripe_read(struct file *file, char __user *buffer, size_t len, loff_t *offset)
+{
+	return fpga_spi_stripe_rw(file->private_data, buffer, len, false);
+}
+
+static ssize_t stripe_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset)
+{
+	return fpga_spi_stripe_rw(file->private_data, (char __user *)buffer, len, true);
+}
+
+static const struct file_operations stripe_fops = {
+	.owner = THIS_MODULE,
+	.open = stripe_open,
+	.read = stripe_read,
+	.write = stripe_write,
+	.llseek = no_llseek,
+};
+
+/*----------------------------------------------------------------------------
+ *UIO export
+ *
+ *With uio=1 the kernel only probes, resets and tears the core down. The
+ *register window is mmap()able from /dev/uioN, uncached, at the offset of
+ *the window within its page, which UIO reports in maps/map0/offset. DONE
+ *raises a UIO event: the handler masks IRQ_ENABLE, a blocking read() or
+ *poll() on /dev/uioN returns the event count, and writing 1 to it unmasks
+ *again. Userspace acks IRQ_STATUS itself. A control loop that only polls the
+ *mapped registers never enters the kernel.
+ *--------------------------------------------------------------------------*/
+#if IS_ENABLED(CONFIG_UIO)
+static irqreturn_t fpga_spi_uio_irq(int irq, struct uio_info *info)
+{
+	struct fpga_spi *spi = info->priv;
+
+	if (!(fpga_spi_readl(spi, FPGA_SPI_IRQ_STATUS) & FPGA_SPI_IRQ_DONE))
+		return IRQ_NONE;
+
+	//Stays masked until userspace has seen the event and writes 1
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, 0);
+	return IRQ_HANDLED;
+}
+
+static int fpga_spi_uio_irqcontrol(struct uio_info *info, s32 on)
+{
+	struct fpga_spi *spi = info->priv;
+
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, on ? FPGA_SPI_IRQ_DONE : 0);
+	return 0;
+}
+
+static int fpga_spi_uio_probe(struct fpga_spi *spi, struct resource *r)
+{
+	struct uio_info *info;
+	struct uio_mem *mem;
+	int ret;
+
+	//The simulator has no physical window to map
+	if (r == NULL) {
+		pr_err("%s: UIO mode needs a register window\n", DRIVER_NAME);
+		return -ENODEV;
+	}
+
+	info = devm_kzalloc(spi->dev, sizeof(*info), GFP_KERNEL);
+	if (info == NULL)
+		return -ENOMEM;
+	info->name = DRIVER_NAME;
+	info->version = "1.0";
+	info->priv = spi;
+
+	//UIO maps whole pages
+	mem = &info->mem[0];
+	mem->name = "registers";
+	mem->memtype = UIO_MEM_PHYS;
+	mem->addr = r->start & PAGE_MASK;
+	mem->offs = r->start & ~PAGE_MASK;
+	mem->size = PAGE_ALIGN(mem->offs + resource_size(r));
+
+	if (spi->irq > 0) {
+		info->irq = spi->irq;
+		info->handler = fpga_spi_uio_irq;
+		info->irqcontrol = fpga_spi_uio_irqcontrol;
+	} else {
+		info->irq = UIO_IRQ_NONE;
+	}
+
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_STATUS, ~0);
+	ret = devm_uio_register_device(spi->dev, info);
+	if (ret) {
+		pr_err("%s failed to register with UIO\n", DRIVER_NAME);
+		return ret;
+	}
+	if (spi->irq > 0)
+		fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, FPGA_SPI_IRQ_DONE);
+
+	spi->uio = info;
+	pr_info("%s exported through UIO\n", DRIVER_NAME);
+	return 0;
+}
+#else
+static int fpga_spi_uio_probe(struct fpga_spi *spi, struct resource *r)
+{
+	pr_err("%s: UIO mode needs CONFIG_UIO\n", DRIVER_NAME);
+	return -ENODEV;
+}
+#endif
+
+static void fpga_spi_release(struct kobject *kobj)
+{
+	struct fpga_spi *spi = container_of(kobj, struct fpga_spi, kobj);
+	u32 i;
+
+	if (spi->cs)
+		for (i = 0; i < spi->num_cs; i++)
+			kfree(spi->cs[i].rx_buf);
+	kfree(spi->cs);
+	free_percpu(spi->submit);
+	fpga_spi_pools_destroy(spi);
+	kfree(spi);
+}
+
+static const struct kobj_type fpga_spi_ktype = {
+	.release = fpga_spi_release,
+};
+
+//Drops probe's reference, last of the devm actions to run
+static void fpga_spi_put(void *data)
+{
+	struct fpga_spi *spi = data;
+
+	kobject_put(&spi->kobj);
+}
 
 static int spi_probe(struct platform_device *pdev)
 {
 	struct fpga_spi *spi;
 	struct resource *r = 0;
+	char name[16];
 	int ret = -EBUSY;
+	u32 i;
 
 	pr_info("Probe function has been called ");
-	
-	/*Platform_get_resource gets information from the device resource 
-	 *either device tree or device module. Includes start/end address etc. 
+
+	spi = kzalloc(sizeof(*spi), GFP_KERNEL);
+	if (spi == NULL)
+		return -ENOMEM;
+	kobject_init(&spi->kobj, &fpga_spi_ktype);
+	ret = devm_add_action_or_reset(&pdev->dev, fpga_spi_put, spi);
+	if (ret)
+		return ret;
+	spi->dev = &pdev->dev;
+	mutex_init(&spi->lock);
+	init_waitqueue_head(&spi->wait);
+	spin_lock_init(&spi->sq_lock);
+	init_waitqueue_head(&spi->sq_wait);
+	raw_spin_lock_init(&spi->acq.lock);
+	init_waitqueue_head(&spi->acq.wait);
+	hrtimer_init(&spi->acq.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+	spi->acq.timer.function = fpga_spi_acq_timer;
+
+	//One device node per chip select, everything starts out as an equal bulk share
+	if (device_property_read_u32(&pdev->dev, "num-cs", &spi->num_cs))
+		spi->num_cs = 1;
+	spi->num_cs = clamp_t(u32, spi->num_cs, 1, FPGA_SPI_MAX_CS);
+	spi->cs = kcalloc(spi->num_cs, sizeof(*spi->cs), GFP_KERNEL);
+	if (spi->cs == NULL)
+		return -ENOMEM;
+	//Zeroed, which is an empty list on every CPU
+	spi->submit = alloc_percpu(struct llist_head);
+	if (spi->submit == NULL)
+		return -ENOMEM;
+	ret = fpga_spi_pools_init(spi);
+	if (ret)
+		return ret;
+	for (i = 0; i < spi->num_cs; i++) {
+		spi->cs[i].spi = spi;
+		spi->cs[i].cs = i;
+		INIT_LIST_HEAD(&spi->cs[i].sq);
+		spi->cs[i].policy = FPGA_SPI_QOS_BULK;
+		spi->cs[i].weight = 1;
+		spi->cs[i].rx_buf = kzalloc(FPGA_SPI_BUF_SIZE, GFP_KERNEL);
+		if (spi->cs[i].rx_buf == NULL)
+			return -ENOMEM;
+	}
+
+	/*Platform_get_resource gets information from the device resource
+	 *either device tree or device module. Includes start/end address etc.
 	 *returns a pointer to struct resource*/
-	r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	
+	spi->sim = dev_get_platdata(&pdev->dev);
+	if (spi->sim == NULL) {
+		r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+		if (r == NULL) {
+			pr_err("IORESOURCE_MEM (register space) does not exist\n");
+			return -ENODEV;
+		}
+		spi->mmio_base = devm_ioremap_resource(&pdev->dev, r);
+		if (IS_ERR(spi->mmio_base))
+			return PTR_ERR(spi->mmio_base);
+	}
+
+	spi->fifo_depth = fpga_spi_readl(spi, FPGA_SPI_FIFO_DEPTH);
+	if (!spi->fifo_depth)
+		spi->fifo_depth = 1;
+	fpga_spi_writel(spi, FPGA_SPI_SLAVE_SEL, ~0);
+	fpga_spi_writel(spi, FPGA_SPI_WIDTH, 31);
+	fpga_spi_writel(spi, FPGA_SPI_CONTROL, FPGA_SPI_CONTROL_ENABLE);
+
+	/*The IRQ resource is optional. When it is there the transfer path sleeps
+	 *until the DONE interrupt instead of spinning on RXLEVEL.*/
+	spi->irq = platform_get_irq_optional(pdev, 0);
+	if (uio) {
+		ret = fpga_spi_uio_probe(spi, r);
+		if (ret == 0)
+			platform_set_drvdata(pdev, spi);
+		return ret;
+	}
+	if (spi->irq > 0) {
+		fpga_spi_writel(spi, FPGA_SPI_IRQ_STATUS, ~0);
+		ret = devm_request_threaded_irq(&pdev->dev, spi->irq, fpga_spi_irq, fpga_spi_irq_thread,
+						0, DRIVER_NAME, spi);
+		if (ret) {
+			pr_err("%s failed to request IRQ %d\n", DRIVER_NAME, spi->irq);
+			return ret;
+		}
+		fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, FPGA_SPI_IRQ_DONE);
+	}
+
+	spi->dispatcher = kthread_run(fpga_spi_dispatch, spi, "%s", DRIVER_NAME);
+	if (IS_ERR(spi->dispatcher))
+		return PTR_ERR(spi->dispatcher);
+
 	//Dynamically allocate a major number
-	majorNumber = registerchrdev(0, DRIVER_NAME, &fops);
-	if (majorNumber<0){
+	ret = alloc_chrdev_region(&spi->devt, 0, spi->num_cs, DRIVER_NAME);
+	if (ret < 0){
 		pr_err("%s failed to register a major number\n",DRIVER_NAME);
-		return majorNumber;
+		goto bad_thread;
 	}
-	
+	spi->id = ida_alloc(&fpga_spi_ida, GFP_KERNEL);
+	if (spi->id < 0) {
+		ret = spi->id;
+		goto bad_region;
+	}
+	majorNumber = MAJOR(spi->devt);
+
 	pr_info("%s registered correctly with major number %d\n",DRIVER_NAME,majorNumber);
-	
-	//Register the device class
-	fpgaspiClass = class_create(THIS_MODULE,CLASS_NAME);
-	if(IS_ERR(fpgaspiClass)){
-		unregister_chrdev(majorNumber, DRIVER_NAME);
-		pr_err("Failed to register device class\n");
-		return PTR_ERR(fpgaspiClass);
-	}
-	pr_info("%s device class registered correctly\n",DRIVER_NAME);
-	
-	//Register the device driver
-	fpgaspiDevice = device_create(fpgaspiClass, NULL, MKDEV(majorNumber, 0), NULL, DRIVER_NAME);
-	if(IS_ERR(fpgaspiDevice)){
-		class_destroy(fpgaspiClass);
-		unregister_chrdev(majorNumber,DRIVER_NAME);
-		pr_err("Failed to create the device\n");
-		return PTR_ERR(fpgaspiDevice);
-	}
-	
+
 	cdev_init(&spi->c_dev,&fops);
-	if (cdev_add(&spi->c_dev, majorNumber,1) == -1){
-		device_destroy(fpgaspiClass(c1, majorNumber);
-		class_destroy(fpgaspiClass);
-		unregister_chrdev(majorNumber,DRIVER_NAME);
-		return -1;
-	} 
-	
-	fpga_spi->mmio_base = ioremap(r->
+	spi->c_dev.owner = THIS_MODULE;
+	cdev_set_parent(&spi->c_dev, &spi->kobj);
+	ret = cdev_add(&spi->c_dev, spi->devt, spi->num_cs);
+	if (ret < 0)
+		goto bad_id;
+
+	/*Register the device nodes. A single chip select keeps the plain name,
+	 *otherwise there is fpga_spi.<cs> per chip select. Cores after the first
+	 *are fpga_spi<id> and fpga_spi<id>.<cs>.*/
+	if (spi->id)
+		snprintf(name, sizeof(name), "%s%d", DRIVER_NAME, spi->id);
+	else
+		strscpy(name, DRIVER_NAME, sizeof(name));
+	for (i = 0; i < spi->num_cs; i++) {
+		if (spi->num_cs == 1)
+			spi->cs[i].dev = device_create(fpgaspiClass, &pdev->dev, spi->devt, NULL, name);
+		else
+			spi->cs[i].dev = device_create(fpgaspiClass, &pdev->dev, spi->devt + i, NULL,
+						       "%s.%u", name, i);
+		if(IS_ERR(spi->cs[i].dev)){
+			pr_err("Failed to create the device\n");
+			ret = PTR_ERR(spi->cs[i].dev);
+			goto bad_device;
+		}
+	}
+
+	ret = fpga_spi_stripe_join(spi);
+	if (ret)
+		goto bad_device;
+
+	//Under <debugfs>/fpga_spi/<device>/, failures only lose the profile
+	spi->debugfs = debugfs_create_dir(dev_name(&pdev->dev), fpga_spi_debugfs_root);
+	reg_prof_init(&spi->prof, &pdev->dev, spi->debugfs, fpga_spi_reg_names);
+
+	platform_set_drvdata(pdev, spi);
 	return 0;
+
+bad_device:
+	while (i--)
+		device_destroy(fpgaspiClass, spi->devt + i);
+	cdev_del(&spi->c_dev);
+bad_id:
+	ida_free(&fpga_spi_ida, spi->id);
+bad_region:
+	unregister_chrdev_region(spi->devt, spi->num_cs);
+bad_thread:
+	kthread_stop(spi->dispatcher);
+	return ret;
 }
 
 static int spi_remove(struct platform_device *pdev)
 {
 	struct fpga_spi *spi;
+	u32 i;
 	pr_info("\n Remove function has been called");
 	spi = platform_get_drvdata(pdev);
 	if (spi == NULL)
 		return -ENODEV;
-		
+
+	//Only the core itself to quiesce, devm unregisters from UIO and frees the line
+	if (spi->uio) {
+		fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, 0);
+		fpga_spi_writel(spi, FPGA_SPI_CONTROL, 0);
+		return 0;
+	}
+
+	debugfs_remove_recursive(spi->debugfs);
+	fpga_spi_stripe_leave(spi);
+	for (i = 0; i < spi->num_cs; i++)
+		device_destroy(fpgaspiClass, spi->devt + i);
+	cdev_del(&spi->c_dev);
+	ida_free(&fpga_spi_ida, spi->id);
+	unregister_chrdev_region(spi->devt, spi->num_cs);
+
+	/*Files still open keep spi but lose the core. Once every submitter that
+	 *missed dead is out of its RCU section the lists only shrink, and what
+	 *the dispatcher left behind fails back with ESHUTDOWN.*/
+	WRITE_ONCE(spi->dead, true);
+	synchronize_rcu();
+	kthread_stop(spi->dispatcher);
+	fpga_spi_drain(spi);
+	mutex_lock(&spi->lock);
+	fpga_spi_acq_stop(spi);
+	mutex_unlock(&spi->lock);
+
+	//The poll loop re-enables DONE on its way out, so let it finish first
+	if (spi->irq > 0)
+		disable_irq(spi->irq);
+	fpga_spi_writel(spi, FPGA_SPI_IRQ_ENABLE, 0);
+	fpga_spi_writel(spi, FPGA_SPI_CONTROL, 0);
+
 	return 0;
 }
 
@@ -156,13 +2299,84 @@ static struct platform_driver spi_driver = {
 	.probe = spi_probe,
 	.remove = spi_remove,
 	.driver = {
-		.name = DRIVER_NAME,  
+		.name = DRIVER_NAME,
 		.owner = THIS_MODULE,
 		.of_match_table = fpga_spi_match,
 	},
 };
 
-module_platform_driver(spi_driver);
+/*The class, the striped devices' minors and the slab caches are shared by
+ *every core, so they live as long as the module rather than a probe.*/
+static int __init fpga_spi_init(void)
+{
+	int ret;
+	u32 i;
+
+	for (i = 0; i < FPGA_SPI_MAX_STRIPES; i++)
+		mutex_init(&fpga_spi_stripes[i].lock);
+
+	fpga_spi_req_cache = kmem_cache_create(DRIVER_NAME "_req", sizeof(struct fpga_spi_req), 0,
+					       SLAB_HWCACHE_ALIGN, NULL);
+	fpga_spi_buf_cache = kmem_cache_create(DRIVER_NAME "_buf", 2 * FPGA_SPI_BUF_SIZE,
+					       sizeof(u32), 0, NULL);
+	if (fpga_spi_req_cache == NULL || fpga_spi_buf_cache == NULL) {
+		ret = -ENOMEM;
+		goto bad_cache;
+	}
+
+	//Register the device class
+	fpgaspiClass = class_create(THIS_MODULE,CLASS_NAME);
+	if(IS_ERR(fpgaspiClass)){
+		pr_err("Failed to register device class\n");
+		ret = PTR_ERR(fpgaspiClass);
+		goto bad_cache;
+	}
+
+	ret = alloc_chrdev_region(&stripe_devt, 0, FPGA_SPI_MAX_STRIPES, "fpga_stripe");
+	if (ret < 0)
+		goto bad_class;
+	cdev_init(&stripe_cdev, &stripe_fops);
+	stripe_cdev.owner = THIS_MODULE;
+	ret = cdev_add(&stripe_cdev, stripe_devt, FPGA_SPI_MAX_STRIPES);
+	if (ret < 0)
+		goto bad_region;
+
+	fpga_spi_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+	//perf counters when lkm_pmu is loaded, attached before probe can count
+	lkm_pmu_attach();
+	ret = platform_driver_register(&spi_driver);
+	if (ret < 0)
+		goto bad_debugfs;
+	return 0;
+
+bad_debugfs:
+	lkm_pmu_detach();
+	debugfs_remove_recursive(fpga_spi_debugfs_root);
+	cdev_del(&stripe_cdev);
+bad_region:
+	unregister_chrdev_region(stripe_devt, FPGA_SPI_MAX_STRIPES);
+bad_class:
+	class_destroy(fpgaspiClass);
+bad_cache:
+	kmem_cache_destroy(fpga_spi_buf_cache);
+	kmem_cache_destroy(fpga_spi_req_cache);
+	return ret;
+}
+
+static void __exit fpga_spi_exit(void)
+{
+	platform_driver_unregister(&spi_driver);
+	debugfs_remove_recursive(fpga_spi_debugfs_root);
+	lkm_pmu_detach();
+	cdev_del(&stripe_cdev);
+	unregister_chrdev_region(stripe_devt, FPGA_SPI_MAX_STRIPES);
+	class_destroy(fpgaspiClass);
+	kmem_cache_destroy(fpga_spi_buf_cache);
+	kmem_cache_destroy(fpga_spi_req_cache);
+}
+
+module_init(fpga_spi_init);
+module_exit(fpga_spi_exit);
 
 //Module information
 MODULE_LICENSE("GPL");
@@ -0,0 +1,20 @@
+/*
+ *@file fpga_sim.h
+ *@author Brad Turcott
+ *@brief Register access hooks handed to the FPGA drivers by the fpga_sim
+ * module. When a platform device carries these as platform_data the driver
+ * skips the IORESOURCE_MEM window and sends every register access here.
+ */
+
+#ifndef FPGA_SIM_H
+#define FPGA_SIM_H
+
+#include <linux/types.h>
+
+struct fpga_sim_ops {
+	u32 (*readl)(void *priv, u32 reg); //reg is the byte offset into the register window
+	void (*writel)(void *priv, u32 reg, u32 val);
+	void *priv;
+};
+
+#endif
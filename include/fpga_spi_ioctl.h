@@ -0,0 +1,125 @@
+/*
+ *@file fpga_spi_ioctl.h
+ *@author Brad Turcott
+ *@brief Userspace interface of the fpga_spi character device. Included by
+ * the driver and by userspace programs that talk to /dev/fpga_spi.
+ */
+
+#ifndef FPGA_SPI_IOCTL_H
+#define FPGA_SPI_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*One asynchronous transfer. tx_buf and rx_buf are userspace pointers, either
+ *may be 0 to clock out zeros or to drop the received data. The data moves as
+ *32 bit words, so len is rounded up to a multiple of 4 on the wire.
+ *
+ *Transfers over 4096 bytes (up to 64 MiB) are zero copy: both buffers stay
+ *pinned until the transfer is off the bus and rx_buf is filled in directly.
+ *Their len and pointers have to be multiples of 4.*/
+struct fpga_spi_xfer {
+	__u64 tag; //Handed back untouched in the completion
+	__u64 tx_buf;
+	__u64 rx_buf;
+	__u32 len; //Bytes
+	__u32 flags;
+};
+
+//Completion entry, read() on an fd with submitted transfers returns an array of these
+struct fpga_spi_cqe {
+	__u64 tag;
+	__s32 result; //Bytes transferred or a negative errno
+	__u32 flags;
+};
+
+//Argument of FPGA_SPI_IOC_SUBMIT
+struct fpga_spi_submit {
+	__u64 xfers; //Pointer to an array of struct fpga_spi_xfer
+	__u32 count; //Entries in that array
+	__u32 pad;
+};
+
+#define FPGA_SPI_ACQ_MAX_WORDS 8
+
+/*Periodic acquisition. Every period_ns the driver clocks tx[0..nwords-1] out
+ *from an hrtimer and appends the received words, timestamped, to a ring of
+ *ring_records entries (rounded up to a power of two).*/
+struct fpga_spi_acq_config {
+	__u64 period_ns;
+	__u32 nwords;
+	__u32 ring_records;
+	__u32 tx[FPGA_SPI_ACQ_MAX_WORDS];
+};
+
+//One sample in the acquisition ring
+struct fpga_spi_acq_record {
+	__u64 timestamp_ns; //CLOCK_MONOTONIC time the transaction was started
+	__u32 seq; //Period number, gaps mean missed or dropped samples
+	__u32 nwords;
+	__u32 data[FPGA_SPI_ACQ_MAX_WORDS];
+};
+
+/*Header at offset 0 of the mmap()ed ring, records follow at record_offset.
+ *The driver advances head, the consumer advances tail. Both count records and
+ *wrap modulo 2^32; the slot of record n is n & (size - 1).*/
+struct fpga_spi_acq_ring {
+	__u32 head;
+	__u32 tail;
+	__u32 size;
+	__u32 record_offset;
+};
+
+//Sampling quality, jitter is how late each timer fired against its ideal time
+struct fpga_spi_acq_stats {
+	__u64 samples; //Records written to the ring
+	__u64 missed; //Periods skipped because the previous transaction was still running
+	__u64 overruns; //Records dropped because the ring was full
+	__u64 jitter_min_ns;
+	__u64 jitter_max_ns;
+	__u64 jitter_sum_ns; //Divide by samples + missed for the mean
+	__u64 jitter_hist[32]; //Bucket n counts jitter in [2^n, 2^(n+1)) ns, bucket 0 also counts 0
+};
+
+//Bus scheduling class of a chip select
+#define FPGA_SPI_QOS_BULK	0 //Weighted fair share of the time left by deadline devices
+#define FPGA_SPI_QOS_DEADLINE	1 //Served first, earliest deadline first
+
+/*QoS of the chip select behind a device node, shared by every file that has
+ *it open. weight (1 to 1024) applies to bulk devices and deadline_ns, counted
+ *from submission, to deadline devices. dispatched and deadline_misses are
+ *only reported by FPGA_SPI_IOC_GET_QOS.*/
+struct fpga_spi_qos {
+	__u32 policy;
+	__u32 weight;
+	__u64 deadline_ns;
+	__u64 dispatched;
+	__u64 deadline_misses;
+};
+
+#define FPGA_SPI_IOC_MAGIC 'f'
+
+/*Queues count transfers and returns how many were accepted. Fewer are
+ *accepted when the file already has a full ring's worth in flight.*/
+#define FPGA_SPI_IOC_SUBMIT	_IOW(FPGA_SPI_IOC_MAGIC, 0, struct fpga_spi_submit)
+
+/*Acquisition control. The file that starts acquisition owns the ring: read()
+ *on it returns whole records and mmap() maps the ring. The bus is reserved
+ *for the engine until FPGA_SPI_IOC_ACQ_STOP or close, other transfers fail
+ *with EBUSY.*/
+#define FPGA_SPI_IOC_ACQ_START	_IOW(FPGA_SPI_IOC_MAGIC, 1, struct fpga_spi_acq_config)
+#define FPGA_SPI_IOC_ACQ_STOP	_IO(FPGA_SPI_IOC_MAGIC, 2)
+#define FPGA_SPI_IOC_ACQ_STATS	_IOR(FPGA_SPI_IOC_MAGIC, 3, struct fpga_spi_acq_stats)
+
+/*cmd_op of IORING_OP_URING_CMD. The SQE has to be 128 bytes (IORING_SETUP_SQE128)
+ *with a struct fpga_spi_xfer in its cmd area; the CQE res is the transfer's
+ *result and user_data is the SQE's, tag is unused. With IORING_URING_CMD_FIXED
+ *both buffers must lie in the registered buffer given by buf_index. Like
+ *plain buffers, transfers over 4096 bytes need 32 bit aligned addresses
+ *and len.*/
+#define FPGA_SPI_URING_CMD_XFER	_IOW(FPGA_SPI_IOC_MAGIC, 6, struct fpga_spi_xfer)
+
+#define FPGA_SPI_IOC_SET_QOS	_IOW(FPGA_SPI_IOC_MAGIC, 4, struct fpga_spi_qos)
+#define FPGA_SPI_IOC_GET_QOS	_IOR(FPGA_SPI_IOC_MAGIC, 5, struct fpga_spi_qos)
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ *@file fpga_spi_regs.h
+ *@author Brad Turcott
+ *@brief Register map of the SPI core in the FPGA fabric. Shared by the
+ * platform_spi and fpga_spi drivers, which both sit on top of this IP.
+ */
+
+#ifndef FPGA_SPI_REGS_H
+#define FPGA_SPI_REGS_H
+
+#include <linux/bits.h>
+
+//Register offsets from the start of the IORESOURCE_MEM window
+#define FPGA_SPI_TXDATA		0x00 //Write pushes one word into the TX FIFO
+#define FPGA_SPI_RXDATA		0x04 //Read pops one word from the RX FIFO
+#define FPGA_SPI_STATUS		0x08
+#define FPGA_SPI_CONTROL	0x0C
+#define FPGA_SPI_SLAVE_SEL	0x10 //Level of each chip select line, bit n = CS n
+#define FPGA_SPI_CLKDIV		0x14 //SCLK = clk / (2 * (CLKDIV + 1))
+#define FPGA_SPI_WIDTH		0x18 //Bits per word minus one
+#define FPGA_SPI_TXLEVEL	0x1C //Words waiting in the TX FIFO
+#define FPGA_SPI_RXLEVEL	0x20 //Words waiting in the RX FIFO
+#define FPGA_SPI_FIFO_DEPTH	0x24 //Read only, depth of each FIFO in words
+#define FPGA_SPI_IRQ_STATUS	0x28 //Latched interrupt causes, write one to clear
+#define FPGA_SPI_IRQ_ENABLE	0x2C //Causes that drive the interrupt line
+#define FPGA_SPI_DMA_CTRL	0x30 //Enables the FIFO DMA request lines
+
+//STATUS register bits
+#define FPGA_SPI_STATUS_TX_EMPTY	BIT(0)
+#define FPGA_SPI_STATUS_TX_FULL		BIT(1)
+#define FPGA_SPI_STATUS_RX_EMPTY	BIT(2)
+#define FPGA_SPI_STATUS_RX_FULL		BIT(3)
+#define FPGA_SPI_STATUS_BUSY		BIT(4) //Shift register is clocking a word
+
+//CONTROL register bits
+#define FPGA_SPI_CONTROL_ENABLE		BIT(0)
+#define FPGA_SPI_CONTROL_CPHA		BIT(1)
+#define FPGA_SPI_CONTROL_CPOL		BIT(2)
+#define FPGA_SPI_CONTROL_LSB_FIRST	BIT(3)
+#define FPGA_SPI_CONTROL_LOOP		BIT(4) //Internal MOSI to MISO loopback
+/*Packed FIFO entries: with WIDTH 7 or 15 every TXDATA/RXDATA access carries
+ *4 or 2 frames, first frame in the low bits. Ignored for wider frames.*/
+#define FPGA_SPI_CONTROL_PACK		BIT(5)
+
+//IRQ_STATUS / IRQ_ENABLE bits
+#define FPGA_SPI_IRQ_DONE		BIT(0) //TX FIFO drained and shift register idle
+
+//DMA_CTRL bits
+#define FPGA_SPI_DMA_TX_EN		BIT(0) //Request TX data while the TX FIFO has room
+#define FPGA_SPI_DMA_RX_EN		BIT(1) //Request RX reads while the RX FIFO has data
+
+#define FPGA_SPI_CLKDIV_MAX		0xFFFF
+#define FPGA_SPI_MAX_CS			32
+
+//Register names indexed by offset / 4, initialiser for profiling tables
+#define FPGA_SPI_REG_NAMES {				\
+	[FPGA_SPI_TXDATA / 4] = "TXDATA",		\
+	[FPGA_SPI_RXDATA / 4] = "RXDATA",		\
+	[FPGA_SPI_STATUS / 4] = "STATUS",		\
+	[FPGA_SPI_CONTROL / 4] = "CONTROL",		\
+	[FPGA_SPI_SLAVE_SEL / 4] = "SLAVE_SEL",		\
+	[FPGA_SPI_CLKDIV / 4] = "CLKDIV",		\
+	[FPGA_SPI_WIDTH / 4] = "WIDTH",			\
+	[FPGA_SPI_TXLEVEL / 4] = "TXLEVEL",		\
+	[FPGA_SPI_RXLEVEL / 4] = "RXLEVEL",		\
+	[FPGA_SPI_FIFO_DEPTH / 4] = "FIFO_DEPTH",	\
+	[FPGA_SPI_IRQ_STATUS / 4] = "IRQ_STATUS",	\
+	[FPGA_SPI_IRQ_ENABLE / 4] = "IRQ_ENABLE",	\
+	[FPGA_SPI_DMA_CTRL / 4] = "DMA_CTRL",		\
+}
+
+#endif
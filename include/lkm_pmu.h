@@ -0,0 +1,66 @@
+/*
+ *@file lkm_pmu.h
+ *@author Brad Turcott
+ *@brief Driver event counters exported by the lkm_pmu module as the "lkm"
+ * perf PMU. Drivers bump them with lkm_pmu_add() from their hot paths, which
+ * is a single per CPU add, and perf reads them next to the CPU counters:
+ *
+ *   perf stat -a -e lkm/spi_bytes/,lkm/spi_xfers/,cycles -- <workload>
+ *
+ * The counters are optional. A driver calls lkm_pmu_attach() from its init,
+ * which finds them through symbol_get() when lkm_pmu is loaded and pins it
+ * until lkm_pmu_detach() at exit. Without lkm_pmu, or when it comes up after
+ * the driver, lkm_pmu_add() does nothing and the driver loads all the same.
+ */
+
+#ifndef LKM_PMU_H
+#define LKM_PMU_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/module.h> //symbol_get
+
+//perf config value of each event, keep in sync with the names in lkm_pmu.c
+enum lkm_pmu_event {
+	LKM_PMU_EBB_MSGS,	//Messages passed through ebbchar, either way
+	LKM_PMU_EBB_BYTES,
+	LKM_PMU_SPI_XFERS,	//Transfers completed by platform_spi and fpga_spi
+	LKM_PMU_SPI_BYTES,
+	LKM_PMU_SPI_IRQS,	//DONE interrupts taken
+	LKM_PMU_SPI_FIFO_DRAINS, //PIO bursts that ran the TX FIFO dry before the refill
+	LKM_PMU_LED_WRITES,	//custom_leds register writes
+	LKM_PMU_EVENTS,
+};
+
+struct lkm_pmu_counts {
+	u64 count[LKM_PMU_EVENTS];
+};
+
+DECLARE_PER_CPU(struct lkm_pmu_counts, lkm_pmu_counts);
+
+//One per driver module, NULL while it isn't counting
+static struct lkm_pmu_counts __percpu *lkm_pmu_hook __maybe_unused;
+
+static inline void lkm_pmu_attach(void)
+{
+	WRITE_ONCE(lkm_pmu_hook, symbol_get(lkm_pmu_counts));
+}
+
+//Only once nothing can call lkm_pmu_add() any more
+static inline void lkm_pmu_detach(void)
+{
+	if (lkm_pmu_hook)
+		symbol_put(lkm_pmu_counts);
+	WRITE_ONCE(lkm_pmu_hook, NULL);
+}
+
+//Safe from any context, including hard IRQ
+static inline void lkm_pmu_add(enum lkm_pmu_event ev, u64 n)
+{
+	struct lkm_pmu_counts __percpu *counts = READ_ONCE(lkm_pmu_hook);
+
+	if (counts)
+		this_cpu_add(counts->count[ev], n);
+}
+
+#endif
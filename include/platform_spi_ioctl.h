@@ -0,0 +1,77 @@
+/*
+ *@file platform_spi_ioctl.h
+ *@author Brad Turcott
+ *@brief Userspace interface of the platform_spi misc device (/dev/spi).
+ * Included by the driver and by userspace programs that talk to it.
+ */
+
+#ifndef PLATFORM_SPI_IOCTL_H
+#define PLATFORM_SPI_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PLATFORM_SPI_IOC_MAGIC 'p'
+
+/*Frame width used by read() and write(), one of 8, 16, 24 or 32. Frames are
+ *stored back to back in the user buffer, little endian, in 1, 2, 3 or 4
+ *bytes. read() and write() only move whole frames.*/
+#define PLATFORM_SPI_IOC_RD_BITS_PER_WORD	_IOR(PLATFORM_SPI_IOC_MAGIC, 1, __u8)
+#define PLATFORM_SPI_IOC_WR_BITS_PER_WORD	_IOW(PLATFORM_SPI_IOC_MAGIC, 1, __u8)
+
+/*Register programs. PLATFORM_SPI_IOC_RUN executes up to PLATFORM_SPI_PROG_MAX_OPS
+ *register operations back to back in the kernel, without other traffic on the
+ *core in between. reg is a byte offset into the register window. Every
+ *PLATFORM_SPI_OP_READ appends the value read to the results array, which must
+ *have room for one __u32 per read op.*/
+#define PLATFORM_SPI_PROG_MAX_OPS	64
+
+#define PLATFORM_SPI_OP_READ		0 //results[n++] = reg
+#define PLATFORM_SPI_OP_WRITE		1 //reg = val
+#define PLATFORM_SPI_OP_MASKED_WRITE	2 //reg = (reg & ~mask) | (val & mask)
+#define PLATFORM_SPI_OP_POLL		3 //wait until (reg & mask) == val, ETIMEDOUT after timeout_us
+#define PLATFORM_SPI_OP_DELAY		4 //wait val microseconds, at most 10000
+
+struct platform_spi_op {
+	__u32 op;
+	__u32 reg;
+	__u32 val;
+	__u32 mask;
+	__u32 timeout_us; //POLL only, 1 to 100000
+	__u32 pad;
+};
+
+struct platform_spi_program {
+	__u64 ops; //Pointer to an array of struct platform_spi_op
+	__u64 results; //Pointer to an array of __u32
+	__u32 nops;
+	__u32 executed; //Set by the driver: ops completed, also on failure
+};
+
+#define PLATFORM_SPI_IOC_RUN		_IOWR(PLATFORM_SPI_IOC_MAGIC, 2, struct platform_spi_program)
+
+/*Transaction capture. Writing 1 to <debugfs>/platform_spi/<device>/capture
+ *clears the ring and starts recording every transfer, controller messages and
+ *misc device read()/write() alike, 0 stops it. Reading the trace file there
+ *drains whole records, each one followed by payload_len bytes of its TX data
+ *padded to a multiple of 8. capture_payload sets how many TX bytes a record
+ *keeps (0, the default, keeps only the CRC). Records that don't fit in the
+ *ring are dropped and counted in capture_dropped.*/
+#define PLATFORM_SPI_TRACE_TX		0x1 //Had TX data, tx_crc and payload are valid
+#define PLATFORM_SPI_TRACE_RX		0x2 //Received data was kept
+#define PLATFORM_SPI_TRACE_MISC		0x4 //Came through /dev/spi rather than the SPI core
+#define PLATFORM_SPI_TRACE_DMA		0x8 //Moved by the DMA engine
+
+struct platform_spi_trace_rec {
+	__u64 timestamp_ns; //CLOCK_MONOTONIC, when the transfer was started
+	__u32 duration_ns;
+	__u32 len; //Bytes
+	__u32 tx_crc; //crc32_le(~0, tx, len) over all of the TX data
+	__u32 speed_hz;
+	__u16 flags;
+	__u8 bits_per_word;
+	__u8 cs; //0 for misc device transfers
+	__u32 payload_len; //Leading TX bytes that follow the record
+};
+
+#endif
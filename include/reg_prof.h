@@ -0,0 +1,208 @@
+/*
+ *@file reg_prof.h
+ *@author Brad Turcott
+ *@brief Register access profiler shared by the FPGA drivers. Counts reads and
+ * writes per register offset and keeps a histogram of how many nanoseconds
+ * each access took, dumped as a table under debugfs.
+ *
+ * Built in with make REG_PROF=y, which defines FPGA_REG_PROF. Without it every
+ * hook below is empty and the accessors compile to what they were. Built in,
+ * it still costs one load per access until enabled through debugfs:
+ *
+ *   <dir>/regprof/enable  0 or 1
+ *   <dir>/regprof/table   one line per register and direction that was hit
+ *   <dir>/regprof/reset   write anything to clear the counters
+ */
+
+#ifndef REG_PROF_H
+#define REG_PROF_H
+
+#include <linux/types.h>
+#include <linux/device.h>
+#include <linux/debugfs.h>
+
+#define REG_PROF_REGS 16 //word offsets 0x00 to 0x3C, higher offsets are counted with 0x3C
+#define REG_PROF_BUCKETS 16 //bucket n holds accesses of 2^n to 2^(n+1) - 1 ns, the last one the rest
+
+enum reg_prof_dir {
+	REG_PROF_READ,
+	REG_PROF_WRITE,
+	REG_PROF_DIRS,
+};
+
+#ifdef FPGA_REG_PROF
+
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/timekeeping.h> //ktime_get_ns, get_cycles() is always 0 on the A9
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+struct reg_prof_reg {
+	u64 count[REG_PROF_DIRS];
+	u64 ns[REG_PROF_DIRS];
+	u64 hist[REG_PROF_DIRS][REG_PROF_BUCKETS];
+};
+
+//Per CPU so accessors on different CPUs never share a line
+struct reg_prof_stats {
+	struct reg_prof_reg reg[REG_PROF_REGS];
+};
+
+struct reg_prof {
+	struct reg_prof_stats __percpu *stats;
+	const char *const *names; //indexed by offset / 4, may be NULL
+	bool enabled;
+};
+
+//Taken before an access, handed to reg_prof_end after it
+struct reg_prof_sample {
+	u64 start;
+	bool on;
+};
+
+static inline struct reg_prof_sample reg_prof_begin(const struct reg_prof *p)
+{
+	struct reg_prof_sample s = { .on = READ_ONCE(p->enabled) };
+
+	if (unlikely(s.on))
+		s.start = ktime_get_ns();
+	return s;
+}
+
+//this_cpu ops are IRQ safe, the IRQ handlers' own accesses can't tear a count
+static inline void reg_prof_end(struct reg_prof *p, struct reg_prof_sample s, u32 reg,
+				enum reg_prof_dir dir)
+{
+	unsigned int slot, bucket;
+	u64 ns;
+
+	if (likely(!s.on))
+		return;
+
+	ns = ktime_get_ns() - s.start;
+	slot = min_t(u32, reg / 4, REG_PROF_REGS - 1);
+	bucket = ns ? min_t(unsigned int, ilog2(ns), REG_PROF_BUCKETS - 1) : 0;
+	this_cpu_inc(p->stats->reg[slot].count[dir]);
+	this_cpu_add(p->stats->reg[slot].ns[dir], ns);
+	this_cpu_inc(p->stats->reg[slot].hist[dir][bucket]);
+}
+
+//A burst of n accesses to one FIFO port, each counted at the burst's mean cost
+static inline void reg_prof_end_rep(struct reg_prof *p, struct reg_prof_sample s, u32 reg,
+				    enum reg_prof_dir dir, unsigned int n)
+{
+	unsigned int slot, bucket;
+	u64 ns, each;
+
+	if (likely(!s.on) || n == 0)
+		return;
+
+	ns = ktime_get_ns() - s.start;
+	each = div_u64(ns, n);
+	slot = min_t(u32, reg / 4, REG_PROF_REGS - 1);
+	bucket = each ? min_t(unsigned int, ilog2(each), REG_PROF_BUCKETS - 1) : 0;
+	this_cpu_add(p->stats->reg[slot].count[dir], n);
+	this_cpu_add(p->stats->reg[slot].ns[dir], ns);
+	this_cpu_add(p->stats->reg[slot].hist[dir][bucket], n);
+}
+
+/*Columns are offset, name, r or w, accesses, mean ns and the histogram
+ *buckets, so tables taken on two firmware versions can be diffed line by line.*/
+static int reg_prof_table_show(struct seq_file *m, void *unused)
+{
+	struct reg_prof *p = m->private;
+	struct reg_prof_reg sum, *r;
+	unsigned int slot, dir, b;
+	int cpu;
+
+	seq_printf(m, "#reg name dir count mean_ns hist[0..%d]\n", REG_PROF_BUCKETS - 1);
+	for (slot = 0; slot < REG_PROF_REGS; slot++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			r = &per_cpu_ptr(p->stats, cpu)->reg[slot];
+			for (dir = 0; dir < REG_PROF_DIRS; dir++) {
+				sum.count[dir] += r->count[dir];
+				sum.ns[dir] += r->ns[dir];
+				for (b = 0; b < REG_PROF_BUCKETS; b++)
+					sum.hist[dir][b] += r->hist[dir][b];
+			}
+		}
+		for (dir = 0; dir < REG_PROF_DIRS; dir++) {
+			if (sum.count[dir] == 0)
+				continue;
+			seq_printf(m, "0x%02x %-12s %c %llu %llu", slot * 4,
+				   p->names && p->names[slot] ? p->names[slot] : "-",
+				   dir == REG_PROF_READ ? 'r' : 'w', sum.count[dir],
+				   div64_u64(sum.ns[dir], sum.count[dir]));
+			for (b = 0; b < REG_PROF_BUCKETS; b++)
+				seq_printf(m, " %llu", sum.hist[dir][b]);
+			seq_putc(m, '\n');
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(reg_prof_table);
+
+//Accesses racing with the reset may survive it, stop the traffic first for a clean slate
+static int reg_prof_reset_set(void *data, u64 val)
+{
+	struct reg_prof *p = data;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(p->stats, cpu), 0, sizeof(struct reg_prof_stats));
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(reg_prof_reset_fops, NULL, reg_prof_reset_set, "%llu\n");
+
+//Counters live as long as dev, the files go with parent
+static inline int reg_prof_init(struct reg_prof *p, struct device *dev, struct dentry *parent,
+				const char *const *names)
+{
+	struct dentry *dir;
+
+	p->stats = devm_alloc_percpu(dev, struct reg_prof_stats);
+	if (p->stats == NULL)
+		return -ENOMEM;
+	p->names = names;
+
+	dir = debugfs_create_dir("regprof", parent);
+	debugfs_create_bool("enable", 0644, dir, &p->enabled);
+	debugfs_create_file("table", 0444, dir, p, &reg_prof_table_fops);
+	debugfs_create_file_unsafe("reset", 0200, dir, p, &reg_prof_reset_fops);
+	return 0;
+}
+
+#else
+
+struct reg_prof {
+};
+
+struct reg_prof_sample {
+};
+
+static inline struct reg_prof_sample reg_prof_begin(const struct reg_prof *p)
+{
+	return (struct reg_prof_sample){ };
+}
+
+static inline void reg_prof_end(struct reg_prof *p, struct reg_prof_sample s, u32 reg,
+				enum reg_prof_dir dir)
+{
+}
+
+static inline void reg_prof_end_rep(struct reg_prof *p, struct reg_prof_sample s, u32 reg,
+				    enum reg_prof_dir dir, unsigned int n)
+{
+}
+
+static inline int reg_prof_init(struct reg_prof *p, struct device *dev, struct dentry *parent,
+				const char *const *names)
+{
+	return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,195 @@
+#include <linux/module.h>
+#include <linux/perf_event.h> //perf_pmu_register
+#include <linux/cpumask.h>
+#include <linux/device.h>
+
+#include "lkm_pmu.h"
+
+/*The "lkm" perf PMU, counting events of the drivers in this tree. The
+ *counters are per CPU adds done by the drivers themselves (see lkm_pmu.h),
+ *an event reads the sum over all CPUs. Like an uncore PMU the events are
+ *system wide: perf opens them once, on the CPU in the cpumask file, so they
+ *need perf stat -a. There is no overflow interrupt, so no sampling either.
+ *
+ *The counting CPU is the first one online at load time. Taking it offline
+ *stops the open events, reopen them after it comes back.*/
+
+DEFINE_PER_CPU(struct lkm_pmu_counts, lkm_pmu_counts);
+EXPORT_PER_CPU_SYMBOL_GPL(lkm_pmu_counts);
+
+static unsigned int lkm_pmu_cpu;
+
+//Sum over every possible CPU, so counts left on a CPU that went offline don't go backwards
+static u64 lkm_pmu_total(unsigned int ev)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(lkm_pmu_counts, cpu).count[ev];
+	return sum;
+}
+
+static void lkm_pmu_event_update(struct perf_event *event)
+{
+	struct hw_perf_event *hwc = &event->hw;
+	u64 prev, now;
+
+	do {
+		prev = local64_read(&hwc->prev_count);
+		now = lkm_pmu_total(event->attr.config);
+	} while (local64_cmpxchg(&hwc->prev_count, prev, now) != prev);
+
+	local64_add(now - prev, &event->count);
+}
+
+static int lkm_pmu_event_init(struct perf_event *event)
+{
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+	if (event->attr.config >= LKM_PMU_EVENTS)
+		return -EINVAL;
+	//The drivers count in whatever context they run in, there is no task to charge
+	if (event->cpu < 0)
+		return -EINVAL;
+	if (is_sampling_event(event))
+		return -EOPNOTSUPP;
+
+	//Opened on several CPUs every one would report the same totals, fold them onto one
+	event->cpu = lkm_pmu_cpu;
+	return 0;
+}
+
+static void lkm_pmu_event_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count, lkm_pmu_total(event->attr.config));
+	event->hw.state = 0;
+}
+
+static void lkm_pmu_event_stop(struct perf_event *event, int flags)
+{
+	struct hw_perf_event *hwc = &event->hw;
+
+	if (hwc->state & PERF_HES_STOPPED)
+		return;
+	if (flags & PERF_EF_UPDATE)
+		lkm_pmu_event_update(event);
+	hwc->state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int lkm_pmu_event_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		lkm_pmu_event_start(event, flags);
+	return 0;
+}
+
+static void lkm_pmu_event_del(struct perf_event *event, int flags)
+{
+	lkm_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static void lkm_pmu_event_read(struct perf_event *event)
+{
+	lkm_pmu_event_update(event);
+}
+
+/* sysfs description of the PMU is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+//Names perf accepts as lkm/<name>/, one per enum lkm_pmu_event
+PMU_EVENT_ATTR_STRING(ebb_msgs, lkm_pmu_ebb_msgs, "event=0");
+PMU_EVENT_ATTR_STRING(ebb_bytes, lkm_pmu_ebb_bytes, "event=1");
+PMU_EVENT_ATTR_STRING(spi_xfers, lkm_pmu_spi_xfers, "event=2");
+PMU_EVENT_ATTR_STRING(spi_bytes, lkm_pmu_spi_bytes, "event=3");
+PMU_EVENT_ATTR_STRING(spi_irqs, lkm_pmu_spi_irqs, "event=4");
+PMU_EVENT_ATTR_STRING(spi_fifo_drains, lkm_pmu_spi_fifo_drains, "event=5");
+PMU_EVENT_ATTR_STRING(led_writes, lkm_pmu_led_writes, "event=6");
+
+static struct attribute *lkm_pmu_events[] = {
+	&lkm_pmu_ebb_msgs.attr.attr,
+	&lkm_pmu_ebb_bytes.attr.attr,
+	&lkm_pmu_spi_xfers.attr.attr,
+	&lkm_pmu_spi_bytes.attr.attr,
+	&lkm_pmu_spi_irqs.attr.attr,
+	&lkm_pmu_spi_fifo_drains.attr.attr,
+	&lkm_pmu_led_writes.attr.attr,
+	NULL,
+};
+
+static const struct attribute_group lkm_pmu_events_group = {
+	.name = "events",
+	.attrs = lkm_pmu_events,
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *lkm_pmu_format[] = {
+	&format_attr_event.attr,
+	NULL,
+};
+
+static const struct attribute_group lkm_pmu_format_group = {
+	.name = "format",
+	.attrs = lkm_pmu_format,
+};
+
+static ssize_t cpumask_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return cpumap_print_to_pagebuf(true, buf, cpumask_of(lkm_pmu_cpu));
+}
+static DEVICE_ATTR_RO(cpumask);
+
+static struct attribute *lkm_pmu_cpumask_attrs[] = {
+	&dev_attr_cpumask.attr,
+	NULL,
+};
+
+static const struct attribute_group lkm_pmu_cpumask_group = {
+	.attrs = lkm_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *lkm_pmu_attr_groups[] = {
+	&lkm_pmu_events_group,
+	&lkm_pmu_format_group,
+	&lkm_pmu_cpumask_group,
+	NULL,
+};
+
+static struct pmu lkm_pmu = {
+	.module = THIS_MODULE,
+	.task_ctx_nr = perf_invalid_context,
+	.capabilities = PERF_PMU_CAP_NO_EXCLUDE,
+	.attr_groups = lkm_pmu_attr_groups,
+	.event_init = lkm_pmu_event_init,
+	.add = lkm_pmu_event_add,
+	.del = lkm_pmu_event_del,
+	.start = lkm_pmu_event_start,
+	.stop = lkm_pmu_event_stop,
+	.read = lkm_pmu_event_read,
+};
+
+static int __init lkm_pmu_init(void)
+{
+	int ret;
+
+	BUILD_BUG_ON(ARRAY_SIZE(lkm_pmu_events) - 1 != LKM_PMU_EVENTS);
+	lkm_pmu_cpu = cpumask_first(cpu_online_mask);
+	ret = perf_pmu_register(&lkm_pmu, "lkm", -1);
+	if (ret)
+		pr_err("Couldn't register the lkm PMU: %d\n", ret);
+	return ret;
+}
+
+static void __exit lkm_pmu_exit(void)
+{
+	perf_pmu_unregister(&lkm_pmu);
+}
+
+module_init(lkm_pmu_init);
+module_exit(lkm_pmu_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Brad Turcott");
+MODULE_DESCRIPTION("perf PMU over the event counters of the FPGA and example drivers.");
+MODULE_VERSION("1.0");
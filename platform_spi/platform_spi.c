@@ -1,159 +1,1732 @@
 #include <linux/module.h>
 #include <linux/platform_device.h> //Platform driver library
 #include <linux/miscdevice.h> //Misc driver library - auto assigns major number 10
-#include <linux/fs.h> //File system library 
+#include <linux/fs.h> //File system library
 #include <linux/clk.h> //needed for clk
 #include <linux/uaccess.h>
 #include <linux/io.h>
+#include <linux/iopoll.h> //read_poll_timeout for FIFO levels
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/of.h>
+#include <linux/dmaengine.h> //Bulk transfers through the FIFO DMA ports
+#include <linux/average.h> //EWMA of burst completion times for adaptive polling
+#include <linux/ktime.h>
+#include <linux/spi/spi.h> //SPI controller framework
+#include <linux/slab.h>
+#include <linux/delay.h> //fsleep for register program delays
+#include <linux/debugfs.h> //PIO/DMA path statistics
+#include <linux/log2.h>
+#include <linux/pm_qos.h> //cpu_latency_qos while the bus is busy
+#include <linux/workqueue.h>
+#include <linux/sched/rt.h>
+#include <linux/sched/signal.h> //fatal_signal_pending between bursts
+#include <linux/vmalloc.h> //Transaction capture ring
+#include <linux/crc32.h>
+#include <linux/spinlock.h>
+
+#include "fpga_spi_regs.h"
+#include "platform_spi_ioctl.h"
+#include "fpga_sim.h"
+#include "reg_prof.h"
+#include "lkm_pmu.h"
 
 #define DRIVER_NAME "platform_spi"
+#define SPI_DEFAULT_NUM_CS 1
+#define SPI_XFER_TIMEOUT_US 100000 //Upper bound for one FIFO burst to drain
+#define SPI_DEFAULT_CLK_HZ 50000000 //h2f_user0_clk when no clock is described
+#define SPI_PROG_MAX_DELAY_US 10000 //Longest PLATFORM_SPI_OP_DELAY
+
+//How transfers are split between the PIO loop and the DMA engine
+enum spi_dma_policy {
+	SPI_DMA_THRESHOLD,	//DMA from dma_min_bytes up
+	SPI_DMA_ADAPTIVE,	//whichever path has measured cheaper for the size class
+	SPI_DMA_NEVER,
+	SPI_DMA_ALWAYS,
+};
+
+static unsigned int dma_policy = SPI_DMA_ADAPTIVE;
+module_param(dma_policy, uint, S_IRUGO);
+MODULE_PARM_DESC(dma_policy, "Initial DMA policy: 0 = threshold, 1 = adaptive, 2 = never, 3 = always");
+
+//Below this many bytes setting up a DMA descriptor costs more than the PIO loop
+static unsigned int dma_min_bytes = 256;
+module_param(dma_min_bytes, uint, S_IRUGO);
+MODULE_PARM_DESC(dma_min_bytes, "Smallest transfer in bytes that is handed to the DMA engine by the threshold policy");
+
+//Deep idle states can take hundreds of us to leave, longer than a whole FIFO burst
+static int qos_latency_us = 50;
+module_param(qos_latency_us, int, S_IRUGO);
+MODULE_PARM_DESC(qos_latency_us, "CPU exit latency bound in us while transfers are outstanding or a real-time client has the device open, -1 = no constraint");
+
+#define SPI_QOS_HOLD_MS 10 //the bound outlives the last transfer this long so back to back messages don't toggle it
+
+static unsigned int capture_kb = 1024;
+module_param(capture_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(capture_kb, "Size of the transaction capture ring in KiB, allocated when capture is first started");
+
+#define SPI_PATH_CLASSES 16 //class n holds transfers of 2^n up to 2^(n+1) - 1 bytes, the last one the rest
+#define SPI_PATH_MIN_SAMPLES 8 //samples of both paths before the cheaper one is trusted
+#define SPI_PATH_EXPLORE 64 //a class retries the losing path once every this many messages
+
+//How spi_wait_burst waits for a burst when an IRQ is available
+enum spi_poll_mode {
+	SPI_POLL_OFF,		//always sleep on the IRQ
+	SPI_POLL_FIXED,		//spin for poll_budget_ns, then sleep
+	SPI_POLL_ADAPTIVE,	//spin for a budget learned from recent bursts
+};
+
+static unsigned int poll_mode = SPI_POLL_ADAPTIVE;
+module_param(poll_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_mode, "Initial poll mode: 0 = IRQ only, 1 = fixed budget, 2 = adaptive");
+
+//Nanoseconds per word, 4 bits of fraction, each new sample weighs 1/8
+DECLARE_EWMA(spi_word, 4, 8)
+//Nanoseconds per transfer scaled to the smallest size of its class, same weighting
+DECLARE_EWMA(spi_cost, 4, 8)
+
+enum spi_path {
+	SPI_PATH_PIO,
+	SPI_PATH_DMA,
+	SPI_PATHS,
+};
+
+//What the adaptive policy has learned about one size class
+struct spi_path_class {
+	struct ewma_spi_cost cost[SPI_PATHS];
+	unsigned long count[SPI_PATHS];
+	u32 choice; //enum spi_path the class uses until the next message ends
+	u32 explore; //messages since the losing path was last tried
+};
 
 //Function prototypes for write and read fops
 static ssize_t spi_read(struct file *file, char *buffer, size_t len, loff_t *offset);
 static ssize_t spi_write(struct file *file, const char *buffer, size_t len, loff_t *offset);
+static long spi_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int spi_open(struct inode *inode, struct file *file);
+static int spi_release(struct inode *inode, struct file *file);
+
 
+/*Transaction capture ring of platform_spi_trace_rec records and their payloads.
+ *head and tail count bytes and run freely, a record that doesn't fit whole is
+ *dropped rather than overwriting ones the reader hasn't taken yet.*/
+struct spi_trace{
+	spinlock_t lock; //producers are the message pump, the misc device and DMA callbacks
+	struct mutex read_lock; //one reader at a time, start and the allocation wait for it
+	void *buf;
+	u32 size; //power of two
+	u32 head, tail;
+	u32 payload_max; //TX bytes kept per record
+	u64 records, dropped;
+	bool on;
+};
 
-struct spi_dev{	
+struct spi_dev{
 	struct miscdevice miscdev;
+	struct spi_controller *ctlr;
 	struct clk *clk;
 	void __iomem *regs; //__iomem is used by sparse to find possible coding faults
-	u32 spi_value; //value to read/write into the avm
+	resource_size_t regs_size; //bytes of register window, bounds register programs
+	const struct fpga_sim_ops *sim; //register model from fpga_sim instead of regs
+	phys_addr_t phys; //bus address of the register window, for the DMA engine
+	struct mutex lock; //serialises the misc device against controller messages
+	u32 fifo_depth; //words per FIFO, read back from the IP
+	u32 cs_level; //shadow of the SLAVE_SEL register
+	u32 control; //shadow of the CONTROL register
+	u32 clkdiv; //shadow of the CLKDIV register
+	u32 width; //shadow of the WIDTH register
+	unsigned long clk_rate; //clk_get_rate, refreshed by clk_nb instead of asked per transfer
+	u32 clk_gen; //bumped on every rate change, stales the dividers cached per spi device
+	struct notifier_block clk_nb;
+	int irq; //transfer complete interrupt, <= 0 when the core is polled
+	wait_queue_head_t wait; //woken from the IRQ thread when a burst drains
+	u32 poll_mode; //enum spi_poll_mode, tunable through sysfs
+	u32 poll_budget_ns; //spin budget in SPI_POLL_FIXED
+	u32 poll_max_ns; //never spin longer than this in SPI_POLL_ADAPTIVE
+	struct ewma_spi_word ns_per_word; //learned burst cost
+	unsigned long poll_hits, poll_misses, irq_waits;
+	u32 *burst; //one FIFO depth of words for the misc device read/write path
+	u32 misc_bpw; //frame width of the misc device, 8, 16, 24 or 32
+	u32 dma_policy; //enum spi_dma_policy, can be pinned through debugfs
+	u32 msg_dma_policy; //dma_policy latched for the message on the bus
+	struct spi_path_class path[SPI_PATH_CLASSES];
+	u32 path_dirty; //classes with samples the choice hasn't seen yet
+	u64 xfer_start; //ns, when the transfer on the bus was started
+	u32 xfer_len;
+	struct spi_transfer *xfer; //the transfer on the bus, for the capture
+	struct spi_trace trace;
+	struct dentry *debugfs;
+	struct reg_prof prof; //register access counts, built with REG_PROF=y
+	struct pm_qos_request qos; //cpu_latency_qos, only added when qos_latency_us >= 0
+	struct mutex qos_lock;
+	unsigned int qos_users; //transfers in flight plus real-time files open
+	struct delayed_work qos_relax; //drops the bound SPI_QOS_HOLD_MS after the last user
 };
-                                                                                                                                                 
+
+//Private data of an open misc device file
+struct spi_file{
+	struct spi_dev *dev;
+	bool rt; //opened by a real-time task, holds a QoS reference until release
+};
+
+/*Settings of one spi device turned into register values, redone by spi_ctlr_setup
+ *whenever a client changes mode, and for the divider when a transfer asks for
+ *another speed or the clock rate moves.*/
+struct spi_cs_state{
+	u32 control; //CONTROL without PACK
+	u32 speed_hz;
+	u32 clkdiv; //for speed_hz at clk_gen
+	u32 clk_gen;
+};
+
+static const char *const spi_reg_names[REG_PROF_REGS] = FPGA_SPI_REG_NAMES;
+
+//Register accessors - every access to the IP goes through these
+static inline u32 spi_readl(struct spi_dev *dev, u32 reg){
+	struct reg_prof_sample s = reg_prof_begin(&dev->prof);
+	u32 val;
+
+	if (unlikely(dev->sim))
+		val = dev->sim->readl(dev->sim->priv, reg);
+	else
+		val = ioread32(dev->regs + reg);
+	reg_prof_end(&dev->prof, s, reg, REG_PROF_READ);
+	return val;
+}
+
+static inline void spi_writel(struct spi_dev *dev, u32 reg, u32 val){
+	struct reg_prof_sample s = reg_prof_begin(&dev->prof);
+
+	if (unlikely(dev->sim))
+		dev->sim->writel(dev->sim->priv, reg, val);
+	else
+		iowrite32(val, dev->regs + reg);
+	reg_prof_end(&dev->prof, s, reg, REG_PROF_WRITE);
+}
+
+//Repeated accesses to one FIFO port, count words from/to buf
+static inline void spi_writesl(struct spi_dev *dev, u32 reg, const u32 *buf, unsigned int count){
+	struct reg_prof_sample s;
+
+	if (unlikely(dev->sim)) {
+		while (count--)
+			spi_writel(dev, reg, *buf++);
+		return;
+	}
+	s = reg_prof_begin(&dev->prof);
+	iowrite32_rep(dev->regs + reg, buf, count);
+	reg_prof_end_rep(&dev->prof, s, reg, REG_PROF_WRITE, count);
+}
+
+static inline void spi_readsl(struct spi_dev *dev, u32 reg, u32 *buf, unsigned int count){
+	struct reg_prof_sample s;
+
+	if (unlikely(dev->sim)) {
+		while (count--)
+			*buf++ = spi_readl(dev, reg);
+		return;
+	}
+	s = reg_prof_begin(&dev->prof);
+	ioread32_rep(dev->regs + reg, buf, count);
+	reg_prof_end_rep(&dev->prof, s, reg, REG_PROF_READ, count);
+}
+
 /* File operations are defined in this section*/
 /*------------------------------------------------------------------------------------*/
 static const struct file_operations spi_fops = {
 	.owner = THIS_MODULE,
+	.open = spi_open,
+	.release = spi_release,
 	.read = spi_read,
-	.write = spi_write
+	.write = spi_write,
+	.unlocked_ioctl = spi_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
-//Platform driver functions 
+
+/* CPU latency QoS is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static void spi_qos_relax(struct work_struct *work){
+	struct spi_dev *dev = container_of(to_delayed_work(work), struct spi_dev, qos_relax);
+
+	mutex_lock(&dev->qos_lock);
+	//A user may have come back while this was waiting for the lock
+	if (dev->qos_users == 0)
+		cpu_latency_qos_update_request(&dev->qos, PM_QOS_DEFAULT_VALUE);
+	mutex_unlock(&dev->qos_lock);
+}
+
+//Keeps the CPUs out of idle states slower to leave than qos_latency_us
+static void spi_qos_get(struct spi_dev *dev){
+	if (!cpu_latency_qos_request_active(&dev->qos))
+		return;
+
+	mutex_lock(&dev->qos_lock);
+	if (dev->qos_users++ == 0) {
+		//The bound may still be held from the last user, updating to the same value is a no-op
+		cancel_delayed_work(&dev->qos_relax);
+		cpu_latency_qos_update_request(&dev->qos, qos_latency_us);
+	}
+	mutex_unlock(&dev->qos_lock);
+}
+
+static void spi_qos_put(struct spi_dev *dev){
+	if (!cpu_latency_qos_request_active(&dev->qos))
+		return;
+
+	mutex_lock(&dev->qos_lock);
+	if (--dev->qos_users == 0)
+		mod_delayed_work(system_wq, &dev->qos_relax, msecs_to_jiffies(SPI_QOS_HOLD_MS));
+	mutex_unlock(&dev->qos_lock);
+}
+
+static void spi_qos_remove(void *data){
+	struct spi_dev *dev = data;
+
+	cancel_delayed_work_sync(&dev->qos_relax);
+	cpu_latency_qos_remove_request(&dev->qos);
+}
+
+//Released by devm after remove has unregistered the controller, so it outlives the last message
+static int spi_qos_init(struct spi_dev *dev, struct device *pdev){
+	mutex_init(&dev->qos_lock);
+	INIT_DELAYED_WORK(&dev->qos_relax, spi_qos_relax);
+	if (qos_latency_us < 0)
+		return 0;
+
+	cpu_latency_qos_add_request(&dev->qos, PM_QOS_DEFAULT_VALUE);
+	return devm_add_action_or_reset(pdev, spi_qos_remove, dev);
+}
+
+/* SPI controller operations are defined in this section*/
+/*------------------------------------------------------------------------------------*/
+//Number of bytes one word occupies in an spi_transfer buffer
+static inline unsigned int spi_word_bytes(unsigned int bpw){
+	if (bpw <= 8)
+		return 1;
+	if (bpw <= 16)
+		return 2;
+	return 4;
+}
+
+static inline u32 spi_get_word(const void *buf, unsigned int i, unsigned int wsize){
+	switch (wsize) {
+	case 1:
+		return ((const u8 *)buf)[i];
+	case 2:
+		return ((const u16 *)buf)[i];
+	default:
+		return ((const u32 *)buf)[i];
+	}
+}
+
+static inline void spi_put_word(void *buf, unsigned int i, unsigned int wsize, u32 word){
+	switch (wsize) {
+	case 1:
+		((u8 *)buf)[i] = word;
+		break;
+	case 2:
+		((u16 *)buf)[i] = word;
+		break;
+	default:
+		((u32 *)buf)[i] = word;
+		break;
+	}
+}
+
+/*Clients sharing the bus mostly run at the same few settings, so CLKDIV, WIDTH
+ *and CONTROL are only written when the value actually changes.*/
+static void spi_set_clkdiv(struct spi_dev *dev, u32 clkdiv){
+	if (clkdiv != dev->clkdiv) {
+		dev->clkdiv = clkdiv;
+		spi_writel(dev, FPGA_SPI_CLKDIV, clkdiv);
+	}
+}
+
+static void spi_set_width(struct spi_dev *dev, u32 width){
+	if (width != dev->width) {
+		dev->width = width;
+		spi_writel(dev, FPGA_SPI_WIDTH, width);
+	}
+}
+
+//Resyncs the shadows after something wrote the registers behind the setters' back
+static void spi_reload_shadows(struct spi_dev *dev){
+	dev->control = spi_readl(dev, FPGA_SPI_CONTROL);
+	dev->clkdiv = spi_readl(dev, FPGA_SPI_CLKDIV);
+	dev->width = spi_readl(dev, FPGA_SPI_WIDTH);
+}
+
+//Sets or clears CONTROL_PACK, touching the register only when it changes
+static void spi_set_pack(struct spi_dev *dev, bool pack){
+	u32 control = pack ? dev->control | FPGA_SPI_CONTROL_PACK : dev->control & ~FPGA_SPI_CONTROL_PACK;
+
+	if (control != dev->control) {
+		dev->control = control;
+		spi_writel(dev, FPGA_SPI_CONTROL, control);
+	}
+}
+
+/*8 and 16 bit frames can travel packed, 4 or 2 per register access. Frames
+ *in memory are then already laid out as FIFO entries, so whole aligned words
+ *go through the 32 bit loop and only a ragged tail goes one frame at a time.*/
+static inline bool spi_can_pack(unsigned int bpw){
+	return bpw == 8 || bpw == 16;
+}
+
+static int spi_pio_xfer(struct spi_dev *dev, const void *tx, void *rx, unsigned int nwords, unsigned int wsize);
+
+static int spi_pio_packed(struct spi_dev *dev, const void *tx, void *rx, unsigned int len, unsigned int wsize){
+	unsigned int nwords = len / sizeof(u32), tail = len % sizeof(u32);
+	int ret;
+
+	if (nwords) {
+		spi_set_pack(dev, true);
+		ret = spi_pio_xfer(dev, tx, rx, nwords, sizeof(u32));
+		if (ret)
+			return ret;
+	}
+	if (tail) {
+		spi_set_pack(dev, false);
+		ret = spi_pio_xfer(dev, tx ? tx + len - tail : NULL, rx ? rx + len - tail : NULL,
+				   tail / wsize, wsize);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+//The static platform device has no clock, so fall back to the fabric default
+static unsigned long spi_clk_rate(struct spi_dev *dev){
+	return READ_ONCE(dev->clk_rate);
+}
+
+//Keeps the cached rate current if something retunes the FPGA clock under us
+static int spi_clk_notify(struct notifier_block *nb, unsigned long event, void *data){
+	struct spi_dev *dev = container_of(nb, struct spi_dev, clk_nb);
+	struct clk_notifier_data *ndata = data;
+
+	if (event == POST_RATE_CHANGE) {
+		WRITE_ONCE(dev->clk_rate, ndata->new_rate ? ndata->new_rate : SPI_DEFAULT_CLK_HZ);
+		WRITE_ONCE(dev->clk_gen, dev->clk_gen + 1);
+	}
+	return NOTIFY_OK;
+}
+
+//Divider for the requested SCLK, rounded so we never exceed speed_hz
+static u32 spi_clkdiv(struct spi_dev *dev, u32 speed_hz){
+	unsigned long rate = spi_clk_rate(dev);
+	u32 div;
+
+	if (!speed_hz)
+		return FPGA_SPI_CLKDIV_MAX;
+	div = DIV_ROUND_UP(rate, 2 * speed_hz);
+	if (div)
+		div--;
+	return min_t(u32, div, FPGA_SPI_CLKDIV_MAX);
+}
+
+//Threaded handler for the DONE interrupt: ack it and wake whoever waits on the burst
+static irqreturn_t spi_irq_thread(int irq, void *dev_id){
+	struct spi_dev *dev = dev_id;
+	u32 status = spi_readl(dev, FPGA_SPI_IRQ_STATUS);
+
+	if (!status)
+		return IRQ_NONE;
+
+	spi_writel(dev, FPGA_SPI_IRQ_STATUS, status);
+	lkm_pmu_add(LKM_PMU_SPI_IRQS, 1);
+	wake_up(&dev->wait);
+
+	return IRQ_HANDLED;
+}
+
+/*Budget for spinning on RXLEVEL before sleeping on the IRQ. In adaptive mode
+ *it is twice the learned time for a burst of this size, and bursts expected
+ *to take longer than poll_max_ns skip spinning altogether.*/
+static u64 spi_poll_budget(struct spi_dev *dev, unsigned int burst){
+	u64 expect;
+
+	switch (READ_ONCE(dev->poll_mode)) {
+	case SPI_POLL_FIXED:
+		return READ_ONCE(dev->poll_budget_ns);
+	case SPI_POLL_ADAPTIVE:
+		expect = (u64)ewma_spi_word_read(&dev->ns_per_word) * burst;
+		if (expect > READ_ONCE(dev->poll_max_ns))
+			return 0;
+		return min_t(u64, 2 * expect, READ_ONCE(dev->poll_max_ns));
+	default:
+		return 0;
+	}
+}
+
+//Sleeps until a burst of words has been clocked back into the RX FIFO
+static int spi_wait_burst(struct spi_dev *dev, unsigned int burst){
+	u64 start, budget;
+	u32 level;
+
+	//The burst is only refilled after it's clocked back, so the TX FIFO always runs dry
+	lkm_pmu_add(LKM_PMU_SPI_FIFO_DRAINS, 1);
+
+	//Without an interrupt there is nothing to sleep on, so spin on the level
+	if (dev->irq <= 0)
+		return read_poll_timeout(spi_readl, level, level >= burst, 0,
+					 SPI_XFER_TIMEOUT_US, false, dev, FPGA_SPI_RXLEVEL);
+
+	start = ktime_get_ns();
+	budget = spi_poll_budget(dev, burst);
+	if (budget) {
+		do {
+			if (spi_readl(dev, FPGA_SPI_RXLEVEL) >= burst) {
+				dev->poll_hits++;
+				goto done;
+			}
+			cpu_relax();
+		} while (ktime_get_ns() - start < budget);
+		dev->poll_misses++;
+	}
+
+	if (!wait_event_timeout(dev->wait, spi_readl(dev, FPGA_SPI_RXLEVEL) >= burst,
+				usecs_to_jiffies(SPI_XFER_TIMEOUT_US)))
+		return -ETIMEDOUT;
+	dev->irq_waits++;
+
+done:
+	ewma_spi_word_add(&dev->ns_per_word, div_u64(ktime_get_ns() - start, burst) ? : 1);
+	return 0;
+}
+
+//Moves nwords through the FIFOs, one FIFO depth at a time
+static int spi_pio_xfer(struct spi_dev *dev, const void *tx, void *rx, unsigned int nwords, unsigned int wsize){
+	unsigned int i, burst;
+	int ret;
+
+	while (nwords) {
+		burst = min(nwords, dev->fifo_depth);
+
+		if (tx && wsize == 4)
+			spi_writesl(dev, FPGA_SPI_TXDATA, tx, burst);
+		else
+			for (i = 0; i < burst; i++)
+				spi_writel(dev, FPGA_SPI_TXDATA, tx ? spi_get_word(tx, i, wsize) : 0);
+
+		//Every word clocked out clocks one word in, so RXLEVEL tells us when the burst is done
+		ret = spi_wait_burst(dev, burst);
+		if (ret) {
+			dev_err(&dev->ctlr->dev, "FIFO burst timed out\n");
+			return ret;
+		}
+
+		if (rx && wsize == 4) {
+			spi_readsl(dev, FPGA_SPI_RXDATA, rx, burst);
+		} else {
+			for (i = 0; i < burst; i++) {
+				u32 word = spi_readl(dev, FPGA_SPI_RXDATA);
+
+				if (rx)
+					spi_put_word(rx, i, wsize, word);
+			}
+		}
+
+		if (tx)
+			tx += burst * wsize;
+		if (rx)
+			rx += burst * wsize;
+		nwords -= burst;
+	}
+
+	return 0;
+}
+
+static void spi_set_cs(struct spi_device *spi, bool level){
+	struct spi_dev *dev = spi_controller_get_devdata(spi->controller);
+
+	//The core has already applied SPI_CS_HIGH, so level is the electrical level
+	if (level)
+		dev->cs_level |= BIT(spi->chip_select);
+	else
+		dev->cs_level &= ~BIT(spi->chip_select);
+	spi_writel(dev, FPGA_SPI_SLAVE_SEL, dev->cs_level);
+}
+
+//Precomputes the register values for a device, the core calls this on every spi_setup()
+static int spi_ctlr_setup(struct spi_device *spi){
+	struct spi_dev *dev = spi_controller_get_devdata(spi->controller);
+	struct spi_cs_state *st = spi_get_ctldata(spi);
+	u32 control = FPGA_SPI_CONTROL_ENABLE;
+
+	if (st == NULL) {
+		st = kzalloc(sizeof(*st), GFP_KERNEL);
+		if (st == NULL)
+			return -ENOMEM;
+		spi_set_ctldata(spi, st);
+	}
+
+	if (spi->mode & SPI_CPHA)
+		control |= FPGA_SPI_CONTROL_CPHA;
+	if (spi->mode & SPI_CPOL)
+		control |= FPGA_SPI_CONTROL_CPOL;
+	if (spi->mode & SPI_LSB_FIRST)
+		control |= FPGA_SPI_CONTROL_LSB_FIRST;
+	if (spi->mode & SPI_LOOP)
+		control |= FPGA_SPI_CONTROL_LOOP;
+	st->control = control;
+	st->speed_hz = spi->max_speed_hz;
+	st->clk_gen = READ_ONCE(dev->clk_gen);
+	st->clkdiv = spi_clkdiv(dev, st->speed_hz);
+
+	return 0;
+}
+
+static void spi_ctlr_cleanup(struct spi_device *spi){
+	kfree(spi_get_ctldata(spi));
+	spi_set_ctldata(spi, NULL);
+}
+
+static int spi_prepare_message(struct spi_controller *ctlr, struct spi_message *msg){
+	struct spi_dev *dev = spi_controller_get_devdata(ctlr);
+	struct spi_cs_state *st = spi_get_ctldata(msg->spi);
+	u32 control;
+
+	//Held until unprepare so the misc device can't interleave with this message
+	mutex_lock(&dev->lock);
+	spi_qos_get(dev);
+
+	//PACK belongs to the transfers, leave it as the last one set it
+	control = st->control | (dev->control & FPGA_SPI_CONTROL_PACK);
+	if (control != dev->control) {
+		dev->control = control;
+		spi_writel(dev, FPGA_SPI_CONTROL, control);
+	}
+
+	//The core asks spi_can_dma again when it unmaps, so the answer can't change mid message
+	dev->msg_dma_policy = READ_ONCE(dev->dma_policy);
+
+	return 0;
+}
+
+static void spi_path_choose(struct spi_dev *dev);
+
+static int spi_unprepare_message(struct spi_controller *ctlr, struct spi_message *msg){
+	struct spi_dev *dev = spi_controller_get_devdata(ctlr);
+
+	//Everything is unmapped by now, safe to move classes to the other path
+	spi_path_choose(dev);
+	spi_qos_put(dev);
+	mutex_unlock(&dev->lock);
+	return 0;
+}
+
+/* Transaction capture is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static inline bool spi_trace_on(struct spi_dev *dev){
+	return unlikely(READ_ONCE(dev->trace.on));
+}
+
+//Copies in at byte position pos of the ring, wrapping at the end
+static void spi_trace_copy(struct spi_trace *tr, u32 pos, const void *src, u32 len){
+	u32 off = pos & (tr->size - 1), first = min(len, tr->size - off);
+
+	memcpy(tr->buf + off, src, first);
+	memcpy(tr->buf, src + first, len - first);
+}
+
+static void spi_trace_peek(struct spi_trace *tr, u32 pos, void *dst, u32 len){
+	u32 off = pos & (tr->size - 1), first = min(len, tr->size - off);
+
+	memcpy(dst, tr->buf + off, first);
+	memcpy(dst + first, tr->buf, len - first);
+}
+
+static int spi_trace_to_user(struct spi_trace *tr, u32 pos, char __user *dst, u32 len){
+	u32 off = pos & (tr->size - 1), first = min(len, tr->size - off);
+
+	if (copy_to_user(dst, tr->buf + off, first) || copy_to_user(dst + first, tr->buf, len - first))
+		return -EFAULT;
+	return 0;
+}
+
+static void spi_trace_put(struct spi_dev *dev, const struct platform_spi_trace_rec *rec, const void *payload){
+	static const u8 pad[8];
+	struct spi_trace *tr = &dev->trace;
+	u32 total = sizeof(*rec) + ALIGN(rec->payload_len, 8);
+	unsigned long flags;
+
+	spin_lock_irqsave(&tr->lock, flags);
+	//Checked again under the lock, stop relies on it before the ring goes away
+	if (!tr->on) {
+		spin_unlock_irqrestore(&tr->lock, flags);
+		return;
+	}
+	if (tr->size - (tr->head - tr->tail) < total) {
+		tr->dropped++;
+	} else {
+		spi_trace_copy(tr, tr->head, rec, sizeof(*rec));
+		spi_trace_copy(tr, tr->head + sizeof(*rec), payload, rec->payload_len);
+		//The padding goes to userspace too, so it can't be left over from older records
+		spi_trace_copy(tr, tr->head + sizeof(*rec) + rec->payload_len, pad,
+			       total - sizeof(*rec) - rec->payload_len);
+		tr->head += total;
+		tr->records++;
+	}
+	spin_unlock_irqrestore(&tr->lock, flags);
+}
+
+//A controller transfer that just finished, from transfer_one or the DMA callback
+static void spi_trace_xfer(struct spi_dev *dev, u16 flags){
+	struct spi_transfer *xfer = dev->xfer;
+	struct platform_spi_trace_rec rec = {
+		.timestamp_ns = dev->xfer_start,
+		.duration_ns = min_t(u64, ktime_get_ns() - dev->xfer_start, U32_MAX),
+		.len = xfer->len,
+		.speed_hz = xfer->speed_hz,
+		.flags = flags,
+		.bits_per_word = xfer->bits_per_word,
+		.cs = dev->ctlr->cur_msg->spi->chip_select,
+	};
+
+	//With MUST_TX/MUST_RX the core fills in its own dummy buffers, those carry no data
+	if (xfer->tx_buf && xfer->tx_buf != dev->ctlr->dummy_tx) {
+		rec.flags |= PLATFORM_SPI_TRACE_TX;
+		rec.tx_crc = crc32_le(~0, xfer->tx_buf, xfer->len);
+		rec.payload_len = min(xfer->len, READ_ONCE(dev->trace.payload_max));
+	}
+	if (xfer->rx_buf && xfer->rx_buf != dev->ctlr->dummy_rx)
+		rec.flags |= PLATFORM_SPI_TRACE_RX;
+	spi_trace_put(dev, &rec, xfer->tx_buf);
+}
+
+/*A misc device read() or write(), after the fact. tx_crc and the payload
+ *were both taken while streaming from the bursts that actually went out.*/
+static void spi_trace_stream(struct spi_dev *dev, const void *payload, u32 payload_len, size_t len,
+			     bool is_read, u32 bpw, u64 start, u32 crc){
+	struct platform_spi_trace_rec rec = {
+		.timestamp_ns = start,
+		.duration_ns = min_t(u64, ktime_get_ns() - start, U32_MAX),
+		.len = len,
+		.speed_hz = spi_clk_rate(dev) / (2 * (READ_ONCE(dev->clkdiv) + 1)),
+		.flags = PLATFORM_SPI_TRACE_MISC | (is_read ? PLATFORM_SPI_TRACE_RX : PLATFORM_SPI_TRACE_TX),
+		.bits_per_word = bpw,
+	};
+
+	if (!is_read) {
+		rec.tx_crc = crc;
+		rec.payload_len = payload ? payload_len : 0;
+	}
+	spi_trace_put(dev, &rec, payload);
+}
+
+//Clears the ring and starts recording, the ring is allocated the first time
+static int spi_trace_start(struct spi_dev *dev){
+	struct spi_trace *tr = &dev->trace;
+	u32 size = roundup_pow_of_two(clamp(capture_kb, 4U, 1U << 16) * 1024);
+	void *buf = NULL;
+
+	mutex_lock(&tr->read_lock);
+	if (tr->buf == NULL) {
+		buf = vzalloc(size);
+		if (buf == NULL) {
+			mutex_unlock(&tr->read_lock);
+			return -ENOMEM;
+		}
+	}
+	spin_lock_irq(&tr->lock);
+	if (buf) {
+		tr->buf = buf;
+		tr->size = size;
+	}
+	tr->head = tr->tail = 0;
+	tr->records = tr->dropped = 0;
+	tr->on = true;
+	spin_unlock_irq(&tr->lock);
+	mutex_unlock(&tr->read_lock);
+
+	return 0;
+}
+
+//Once this returns no producer is left inside spi_trace_put
+static void spi_trace_stop(struct spi_dev *dev){
+	spin_lock_irq(&dev->trace.lock);
+	dev->trace.on = false;
+	spin_unlock_irq(&dev->trace.lock);
+}
+
+//Hands out whole records only, a buffer too small for the next one gets EINVAL
+static ssize_t spi_trace_read(struct file *file, char __user *ubuf, size_t count, loff_t *ppos){
+	struct spi_dev *dev = file->private_data;
+	struct spi_trace *tr = &dev->trace;
+	struct platform_spi_trace_rec rec;
+	u32 head, tail, total;
+	size_t done = 0;
+	ssize_t ret = 0;
+
+	mutex_lock(&tr->read_lock);
+	if (tr->buf == NULL)
+		goto out;
+
+	//Producers only write past head, so what lies before it can be copied unlocked
+	spin_lock_irq(&tr->lock);
+	head = tr->head;
+	tail = tr->tail;
+	spin_unlock_irq(&tr->lock);
+
+	while (tail != head) {
+		spi_trace_peek(tr, tail, &rec, sizeof(rec));
+		total = sizeof(rec) + ALIGN(rec.payload_len, 8);
+		if (done + total > count) {
+			if (done == 0)
+				ret = -EINVAL;
+			break;
+		}
+		if (spi_trace_to_user(tr, tail, ubuf + done, total)) {
+			ret = -EFAULT;
+			break;
+		}
+		done += total;
+		tail += total;
+	}
+
+	spin_lock_irq(&tr->lock);
+	tr->tail = tail;
+	spin_unlock_irq(&tr->lock);
+out:
+	mutex_unlock(&tr->read_lock);
+	return done ? done : ret;
+}
+
+static const struct file_operations spi_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.read = spi_trace_read,
+	.llseek = no_llseek,
+};
+
+static int spi_capture_get(void *data, u64 *val){
+	*val = READ_ONCE(((struct spi_dev *)data)->trace.on);
+	return 0;
+}
+
+static int spi_capture_set(void *data, u64 val){
+	if (val > 1)
+		return -EINVAL;
+	if (val)
+		return spi_trace_start(data);
+	spi_trace_stop(data);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spi_capture_fops, spi_capture_get, spi_capture_set, "%llu\n");
+
+/* PIO versus DMA selection is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static inline u32 spi_path_class(unsigned int len){
+	return min_t(u32, ilog2(max(len, 1U)), SPI_PATH_CLASSES - 1);
+}
+
+//Accounts the transfer started at xfer_start to path, once it has finished
+static void spi_path_record(struct spi_dev *dev, enum spi_path path){
+	u32 c = spi_path_class(dev->xfer_len);
+	u64 ns = ktime_get_ns() - dev->xfer_start;
+
+	//Scaled to 2^c bytes so the spread of sizes within a class doesn't skew it
+	ewma_spi_cost_add(&dev->path[c].cost[path], div_u64(ns << c, max(dev->xfer_len, 1U)));
+	dev->path[c].count[path]++;
+	dev->path_dirty |= BIT(c);
+}
+
+/*Runs after each message for the classes it touched. A class tries PIO, then
+ *DMA, until both have SPI_PATH_MIN_SAMPLES, then sticks to the cheaper one but
+ *keeps probing the other now and then so a change in bus clock or load is
+ *noticed. Without DMA channels everything stays on PIO.*/
+static void spi_path_choose(struct spi_dev *dev){
+	unsigned long dirty = dev->path_dirty;
+	struct spi_path_class *pc;
+	u32 c, best;
+
+	for_each_set_bit(c, &dirty, SPI_PATH_CLASSES) {
+		pc = &dev->path[c];
+		if (dev->ctlr->dma_rx == NULL || pc->count[SPI_PATH_PIO] < SPI_PATH_MIN_SAMPLES) {
+			best = SPI_PATH_PIO;
+		} else if (pc->count[SPI_PATH_DMA] < SPI_PATH_MIN_SAMPLES) {
+			best = SPI_PATH_DMA;
+		} else {
+			best = ewma_spi_cost_read(&pc->cost[SPI_PATH_DMA]) <
+			       ewma_spi_cost_read(&pc->cost[SPI_PATH_PIO]) ? SPI_PATH_DMA : SPI_PATH_PIO;
+			if (++pc->explore >= SPI_PATH_EXPLORE) {
+				pc->explore = 0;
+				best = !best;
+			}
+		}
+		pc->choice = best;
+	}
+	dev->path_dirty = 0;
+}
+
+/* DMA engine path is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+//The core maps tx_sg/rx_sg for us whenever this returns true
+static bool spi_can_dma(struct spi_controller *ctlr, struct spi_device *spi, struct spi_transfer *xfer){
+	struct spi_dev *dev = spi_controller_get_devdata(ctlr);
+
+	switch (dev->msg_dma_policy) {
+	case SPI_DMA_ADAPTIVE:
+		return dev->path[spi_path_class(xfer->len)].choice == SPI_PATH_DMA;
+	case SPI_DMA_NEVER:
+		return false;
+	case SPI_DMA_ALWAYS:
+		return true;
+	default:
+		return xfer->len >= dma_min_bytes;
+	}
+}
+
+//The RX channel finishes last, so its callback ends the transfer
+static void spi_dma_rx_done(void *arg){
+	struct spi_dev *dev = arg;
+
+	spi_writel(dev, FPGA_SPI_DMA_CTRL, 0);
+	spi_path_record(dev, SPI_PATH_DMA);
+	lkm_pmu_add(LKM_PMU_SPI_XFERS, 1);
+	lkm_pmu_add(LKM_PMU_SPI_BYTES, dev->xfer_len);
+	if (spi_trace_on(dev))
+		spi_trace_xfer(dev, PLATFORM_SPI_TRACE_DMA);
+	spi_finalize_current_transfer(dev->ctlr);
+}
+
+static int spi_dma_config(struct spi_dev *dev, unsigned int wsize){
+	struct dma_slave_config cfg = {
+		.src_addr = dev->phys + FPGA_SPI_RXDATA,
+		.dst_addr = dev->phys + FPGA_SPI_TXDATA,
+		.src_addr_width = wsize,
+		.dst_addr_width = wsize,
+		.src_maxburst = dev->fifo_depth / 2 ? dev->fifo_depth / 2 : 1,
+		.dst_maxburst = dev->fifo_depth / 2 ? dev->fifo_depth / 2 : 1,
+	};
+	int ret;
+
+	cfg.direction = DMA_DEV_TO_MEM;
+	ret = dmaengine_slave_config(dev->ctlr->dma_rx, &cfg);
+	if (ret)
+		return ret;
+	cfg.direction = DMA_MEM_TO_DEV;
+	return dmaengine_slave_config(dev->ctlr->dma_tx, &cfg);
+}
+
+//Queues both directions and returns 1 so the core waits for spi_dma_rx_done
+static int spi_dma_xfer(struct spi_dev *dev, struct spi_transfer *xfer, unsigned int wsize){
+	struct spi_controller *ctlr = dev->ctlr;
+	struct dma_async_tx_descriptor *rxd, *txd;
+	int ret;
+
+	ret = spi_dma_config(dev, wsize);
+	if (ret)
+		return ret;
+
+	rxd = dmaengine_prep_slave_sg(ctlr->dma_rx, xfer->rx_sg.sgl, xfer->rx_sg.nents,
+				      DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!rxd)
+		return -EIO;
+	txd = dmaengine_prep_slave_sg(ctlr->dma_tx, xfer->tx_sg.sgl, xfer->tx_sg.nents,
+				      DMA_MEM_TO_DEV, DMA_CTRL_ACK);
+	if (!txd) {
+		dmaengine_terminate_sync(ctlr->dma_rx);
+		return -EIO;
+	}
+
+	rxd->callback = spi_dma_rx_done;
+	rxd->callback_param = dev;
+
+	//RX has to be listening before TX starts clocking or the RX FIFO can overflow
+	dmaengine_submit(rxd);
+	dmaengine_submit(txd);
+	dma_async_issue_pending(ctlr->dma_rx);
+	dma_async_issue_pending(ctlr->dma_tx);
+	spi_writel(dev, FPGA_SPI_DMA_CTRL, FPGA_SPI_DMA_TX_EN | FPGA_SPI_DMA_RX_EN);
+
+	return 1;
+}
+
+//Called by the core when a DMA transfer times out
+static void spi_handle_err(struct spi_controller *ctlr, struct spi_message *msg){
+	struct spi_dev *dev = spi_controller_get_devdata(ctlr);
+
+	if (ctlr->dma_tx)
+		dmaengine_terminate_sync(ctlr->dma_tx);
+	if (ctlr->dma_rx)
+		dmaengine_terminate_sync(ctlr->dma_rx);
+	spi_writel(dev, FPGA_SPI_DMA_CTRL, 0);
+}
+
+static void spi_dma_release(void *data){
+	struct spi_controller *ctlr = data;
+
+	dma_release_channel(ctlr->dma_tx);
+	dma_release_channel(ctlr->dma_rx);
+}
+
+/*Picks up the "tx" and "rx" channels from the device tree. Missing channels
+ *are not an error - every transfer then goes through the PIO loop.*/
+static int spi_dma_init(struct spi_dev *dev, struct device *pdev){
+	struct spi_controller *ctlr = dev->ctlr;
+	struct dma_chan *tx, *rx;
+
+	tx = dma_request_chan(pdev, "tx");
+	if (IS_ERR(tx))
+		return PTR_ERR(tx) == -EPROBE_DEFER ? -EPROBE_DEFER : 0;
+	rx = dma_request_chan(pdev, "rx");
+	if (IS_ERR(rx)) {
+		dma_release_channel(tx);
+		return PTR_ERR(rx) == -EPROBE_DEFER ? -EPROBE_DEFER : 0;
+	}
+
+	ctlr->dma_tx = tx;
+	ctlr->dma_rx = rx;
+	ctlr->can_dma = spi_can_dma;
+	//DMA always moves both directions, so let the core supply dummy buffers
+	ctlr->flags |= SPI_CONTROLLER_MUST_TX | SPI_CONTROLLER_MUST_RX;
+	pr_info("Using DMA channels %s/%s\n", dma_chan_name(tx), dma_chan_name(rx));
+
+	//Released by devm after remove has unregistered the controller
+	return devm_add_action_or_reset(pdev, spi_dma_release, ctlr);
+}
+
+static int spi_transfer_one(struct spi_controller *ctlr, struct spi_device *spi, struct spi_transfer *xfer){
+	struct spi_dev *dev = spi_controller_get_devdata(ctlr);
+	struct spi_cs_state *st = spi_get_ctldata(spi);
+	unsigned int wsize = spi_word_bytes(xfer->bits_per_word);
+	bool pack = spi_can_pack(xfer->bits_per_word);
+	int ret;
+
+	dev->xfer_start = ktime_get_ns();
+	dev->xfer_len = xfer->len;
+	dev->xfer = xfer;
+
+	//Only a new speed or a new clock rate costs a division
+	if (xfer->speed_hz != st->speed_hz || st->clk_gen != READ_ONCE(dev->clk_gen)) {
+		st->speed_hz = xfer->speed_hz;
+		st->clk_gen = READ_ONCE(dev->clk_gen);
+		st->clkdiv = spi_clkdiv(dev, st->speed_hz);
+	}
+	spi_set_clkdiv(dev, st->clkdiv);
+	spi_set_width(dev, xfer->bits_per_word - 1);
+
+	//Packed DMA moves whole words, so the length has to be a multiple of four
+	if (ctlr->cur_msg_mapped && spi_can_dma(ctlr, spi, xfer)) {
+		pack = pack && IS_ALIGNED(xfer->len, sizeof(u32));
+		spi_set_pack(dev, pack);
+		return spi_dma_xfer(dev, xfer, pack ? sizeof(u32) : wsize);
+	}
+
+	//The 32 bit loop uses the _rep accessors, which want aligned buffers
+	if (pack && IS_ALIGNED((unsigned long)xfer->tx_buf | (unsigned long)xfer->rx_buf, sizeof(u32))) {
+		ret = spi_pio_packed(dev, xfer->tx_buf, xfer->rx_buf, xfer->len, wsize);
+	} else {
+		spi_set_pack(dev, false);
+		ret = spi_pio_xfer(dev, xfer->tx_buf, xfer->rx_buf, xfer->len / wsize, wsize);
+	}
+
+	//Returning 0 tells the core the transfer already finished
+	if (ret == 0) {
+		spi_path_record(dev, SPI_PATH_PIO);
+		lkm_pmu_add(LKM_PMU_SPI_XFERS, 1);
+		lkm_pmu_add(LKM_PMU_SPI_BYTES, xfer->len);
+		if (spi_trace_on(dev))
+			spi_trace_xfer(dev, 0);
+	}
+	return ret;
+}
+
+/* Debugfs view of the path selection is defined in this section*/
+/*------------------------------------------------------------------------------------*/
+static struct dentry *spi_debugfs_root;
+
+//Per class costs and counts, and the size from which adaptive mode goes to DMA
+static int spi_paths_show(struct seq_file *s, void *unused){
+	struct spi_dev *dev = s->private;
+	struct spi_path_class *pc;
+	int c;
+
+	//The smallest size from which every class that has seen traffic picks DMA
+	for (c = SPI_PATH_CLASSES - 1; c >= 0; c--) {
+		pc = &dev->path[c];
+		if (pc->choice != SPI_PATH_DMA && (pc->count[SPI_PATH_PIO] || pc->count[SPI_PATH_DMA]))
+			break;
+	}
+	seq_printf(s, "policy %u dma_min_bytes %u\n", READ_ONCE(dev->dma_policy), dma_min_bytes);
+	if (c == SPI_PATH_CLASSES - 1)
+		seq_puts(s, "learned threshold none\n");
+	else
+		seq_printf(s, "learned threshold %lu\n", c < 0 ? 0UL : BIT(c + 1));
+
+	seq_printf(s, "%10s %10s %10s %10s %10s %5s\n", "bytes", "pio_ns", "pio_n", "dma_ns", "dma_n", "pick");
+	for (c = 0; c < SPI_PATH_CLASSES; c++) {
+		pc = &dev->path[c];
+		if (!pc->count[SPI_PATH_PIO] && !pc->count[SPI_PATH_DMA])
+			continue;
+		seq_printf(s, "%10lu %10lu %10lu %10lu %10lu %5s\n", BIT(c),
+			   ewma_spi_cost_read(&pc->cost[SPI_PATH_PIO]), pc->count[SPI_PATH_PIO],
+			   ewma_spi_cost_read(&pc->cost[SPI_PATH_DMA]), pc->count[SPI_PATH_DMA],
+			   pc->choice == SPI_PATH_DMA ? "dma" : "pio");
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(spi_paths);
+
+//Writing pins a policy from the next message on, 1 goes back to adaptive
+static int spi_dma_policy_get(void *data, u64 *val){
+	*val = READ_ONCE(((struct spi_dev *)data)->dma_policy);
+	return 0;
+}
+
+static int spi_dma_policy_set(void *data, u64 val){
+	if (val > SPI_DMA_ALWAYS)
+		return -EINVAL;
+	WRITE_ONCE(((struct spi_dev *)data)->dma_policy, val);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spi_dma_policy_fops, spi_dma_policy_get, spi_dma_policy_set, "%llu\n");
+
+//Under <debugfs>/platform_spi/<device>/, failures only lose the statistics
+static void spi_debugfs_init(struct spi_dev *dev, struct device *pdev){
+	dev->debugfs = debugfs_create_dir(dev_name(pdev), spi_debugfs_root);
+	debugfs_create_file("paths", 0444, dev->debugfs, dev, &spi_paths_fops);
+	debugfs_create_file_unsafe("dma_policy", 0644, dev->debugfs, dev, &spi_dma_policy_fops);
+	reg_prof_init(&dev->prof, pdev, dev->debugfs, spi_reg_names);
+	debugfs_create_file_unsafe("capture", 0644, dev->debugfs, dev, &spi_capture_fops);
+	debugfs_create_u32("capture_payload", 0644, dev->debugfs, &dev->trace.payload_max);
+	debugfs_create_u64("capture_records", 0444, dev->debugfs, &dev->trace.records);
+	debugfs_create_u64("capture_dropped", 0444, dev->debugfs, &dev->trace.dropped);
+	debugfs_create_file("trace", 0400, dev->debugfs, dev, &spi_trace_fops);
+}
+
+//Platform driver functions
 /*---------------------------------------------------------------------------*/
 static int spi_probe(struct platform_device *pdev){
-	
+
+	struct spi_controller *ctlr;
 	struct spi_dev *dev;
 	struct resource *r = 0;
+	u32 num_cs = SPI_DEFAULT_NUM_CS;
+	u32 bpw = 32;
 	int ret = 0;
-	
-	pr_info("\n Probe function was called!");
+	u32 i;
 
-    	// Get the memory resources for this LED device
-    	//r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    	//if(r == NULL) {
-        //	pr_err("IORESOURCE_MEM (register space) does not exist\n");
-       	//	goto bad_exit_return;
-   	//}
+	pr_info("\n Probe function was called!");
 
-	dev = devm_kzalloc(&pdev->dev, sizeof(*dev), GFP_KERNEL);
-	if (dev = NULL)
+	//The driver data lives inside the controller so the SPI core owns its lifetime
+	ctlr = devm_spi_alloc_master(&pdev->dev, sizeof(*dev));
+	if (ctlr == NULL)
 		return -ENOMEM;
-	
+	dev = spi_controller_get_devdata(ctlr);
+	dev->ctlr = ctlr;
+	mutex_init(&dev->lock);
+	init_waitqueue_head(&dev->wait);
+	spin_lock_init(&dev->trace.lock);
+	mutex_init(&dev->trace.read_lock);
+	dev->poll_mode = poll_mode;
+	dev->poll_budget_ns = 5000;
+	dev->poll_max_ns = 10000;
+	ewma_spi_word_init(&dev->ns_per_word);
+	dev->dma_policy = min_t(u32, dma_policy, SPI_DMA_ALWAYS);
+	for (i = 0; i < SPI_PATH_CLASSES; i++) {
+		ewma_spi_cost_init(&dev->path[i].cost[SPI_PATH_PIO]);
+		ewma_spi_cost_init(&dev->path[i].cost[SPI_PATH_DMA]);
+	}
+
 	pr_info("\n Memory was allocated \n");
-	
-	dev->clk = devm_clk_get(&pdev->dev, NULL);
+
+	dev->clk = devm_clk_get_optional(&pdev->dev, NULL);
 	if (IS_ERR(dev->clk))
 		return PTR_ERR(dev->clk);
+	ret = clk_prepare_enable(dev->clk);
+	if (ret)
+		return ret;
+	dev->clk_rate = clk_get_rate(dev->clk);
+	if (!dev->clk_rate)
+		dev->clk_rate = SPI_DEFAULT_CLK_HZ;
+	if (dev->clk) {
+		dev->clk_nb.notifier_call = spi_clk_notify;
+		ret = devm_clk_notifier_register(&pdev->dev, dev->clk, &dev->clk_nb);
+		if (ret)
+			goto bad_clk;
+	}
 	pr_info("\n Memory for clk was allocated \n");
-	r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	pr_info("\n Platform resources were obtained. \n");
-	dev->regs = devm_ioremap_resource(&pdev->dev, r);
-	pr_info("\n IORESOURCE was obtained and remapped");
-    	if(IS_ERR(dev->regs))
-        	goto bad_ioremap;
-	
+
+	//The fpga_sim module hands us a register model instead of a register window
+	dev->sim = dev_get_platdata(&pdev->dev);
+	if (dev->sim == NULL) {
+		r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+		if(r == NULL) {
+			pr_err("IORESOURCE_MEM (register space) does not exist\n");
+			ret = -ENODEV;
+			goto bad_clk;
+		}
+		pr_info("\n Platform resources were obtained. \n");
+		dev->phys = r->start;
+		dev->regs = devm_ioremap_resource(&pdev->dev, r);
+		pr_info("\n IORESOURCE was obtained and remapped");
+		if(IS_ERR(dev->regs))
+			goto bad_ioremap;
+		dev->regs_size = resource_size(r);
+	} else {
+		dev->regs_size = FPGA_SPI_DMA_CTRL + sizeof(u32);
+	}
+
+	//Bring the core up with every chip select released
+	dev->fifo_depth = spi_readl(dev, FPGA_SPI_FIFO_DEPTH);
+	if (!dev->fifo_depth)
+		dev->fifo_depth = 1;
+	dev->burst = devm_kcalloc(&pdev->dev, dev->fifo_depth, sizeof(u32), GFP_KERNEL);
+	if (dev->burst == NULL) {
+		ret = -ENOMEM;
+		goto bad_clk;
+	}
+	device_property_read_u32(&pdev->dev, "num-cs", &num_cs);
+	num_cs = min_t(u32, num_cs, FPGA_SPI_MAX_CS);
+	dev->cs_level = ~0;
+	spi_writel(dev, FPGA_SPI_SLAVE_SEL, dev->cs_level);
+	spi_writel(dev, FPGA_SPI_CONTROL, FPGA_SPI_CONTROL_ENABLE);
+	spi_reload_shadows(dev);
+
+	//Frame width of the misc device until userspace picks another
+	device_property_read_u32(&pdev->dev, "bits-per-word", &bpw);
+	dev->misc_bpw = (bpw == 8 || bpw == 16 || bpw == 24) ? bpw : 32;
+
+	//The IRQ is optional, without it bursts are detected by polling RXLEVEL
+	dev->irq = platform_get_irq_optional(pdev, 0);
+	if (dev->irq > 0) {
+		spi_writel(dev, FPGA_SPI_IRQ_STATUS, ~0);
+		ret = devm_request_threaded_irq(&pdev->dev, dev->irq, NULL, spi_irq_thread,
+						IRQF_ONESHOT, DRIVER_NAME, dev);
+		if (ret) {
+			pr_err("Couldn't request IRQ %d\n", dev->irq);
+			goto bad_clk;
+		}
+		spi_writel(dev, FPGA_SPI_IRQ_ENABLE, FPGA_SPI_IRQ_DONE);
+	}
+
+	ctlr->dev.of_node = pdev->dev.of_node;
+	ctlr->bus_num = pdev->id;
+	ctlr->num_chipselect = num_cs;
+	ctlr->mode_bits = SPI_CPOL | SPI_CPHA | SPI_CS_HIGH | SPI_LSB_FIRST | SPI_LOOP;
+	ctlr->bits_per_word_mask = SPI_BPW_RANGE_MASK(1, 32);
+	ctlr->max_speed_hz = spi_clk_rate(dev) / 2;
+	ctlr->min_speed_hz = DIV_ROUND_UP(spi_clk_rate(dev), 2 * (FPGA_SPI_CLKDIV_MAX + 1));
+	ctlr->set_cs = spi_set_cs;
+	ctlr->setup = spi_ctlr_setup;
+	ctlr->cleanup = spi_ctlr_cleanup;
+	ctlr->prepare_message = spi_prepare_message;
+	ctlr->unprepare_message = spi_unprepare_message;
+	ctlr->transfer_one = spi_transfer_one;
+	ctlr->handle_err = spi_handle_err;
+
+	//A simulated core has no FIFO ports a DMA engine could reach
+	if (dev->sim == NULL) {
+		ret = spi_dma_init(dev, &pdev->dev);
+		if (ret)
+			goto bad_clk;
+	}
+
+	ret = spi_qos_init(dev, &pdev->dev);
+	if (ret)
+		goto bad_clk;
+
 	dev->miscdev.minor = MISC_DYNAMIC_MINOR;
 	dev->miscdev.name = "spi";
-	dev->miscdev.fops = &spi_fops;	
-	
+	dev->miscdev.fops = &spi_fops;
+
 	ret = misc_register(&dev->miscdev);
 	if(ret !=0) {
 		pr_info("\n Couldn't register misc device");
-		goto bad_exit_return;
+		goto bad_clk;
 	}
-	
+
 	platform_set_drvdata(pdev, (void*)dev);
+
+	//Not devm, remove has to take the controller down before the core and its clock
+	ret = spi_register_controller(ctlr);
+	if (ret != 0) {
+		pr_err("Couldn't register spi controller\n");
+		goto bad_misc;
+	}
+
+	spi_debugfs_init(dev, &pdev->dev);
 	pr_info("spi_probe exit\n");
-	
+
 	return 0;
 
 bad_ioremap:
 	ret = PTR_ERR(dev->regs);
+	goto bad_clk;
 
-bad_exit_return:
+bad_misc:
+	misc_deregister(&dev->miscdev);
+bad_clk:
+	clk_disable_unprepare(dev->clk);
 	pr_err("spi_probe bad exit\n");
 	return ret;
 }
 
 static int spi_remove(struct platform_device *pdev){
-	pr_info("\n Remove function was called!");
-	
 	struct spi_dev *dev = (struct spi_dev*)platform_get_drvdata(pdev);
-	
+
+	pr_info("\n Remove function was called!");
+
+	//Flushes the message queue, nothing reaches the core after this
+	spi_unregister_controller(dev->ctlr);
+	debugfs_remove_recursive(dev->debugfs);
 	misc_deregister(&dev->miscdev);
-	 
+	spi_trace_stop(dev);
+	vfree(dev->trace.buf);
+	spi_writel(dev, FPGA_SPI_IRQ_ENABLE, 0);
+	spi_writel(dev, FPGA_SPI_CONTROL, 0);
+	clk_disable_unprepare(dev->clk);
+
 	return 0;
 }
 
+static const struct of_device_id spi_dt_ids[] = {
+	{ .compatible = "altr,platform_spi" },
+	{ /* end of table */ }
+};
+
+MODULE_DEVICE_TABLE(of, spi_dt_ids);
+
 //Defines the structure for the platform driver
+//Sysfs knobs for the burst wait, under /sys/bus/platform/devices/<dev>/
+static ssize_t spi_show_u32(struct device *d, char *buf, u32 *val){
+	return sysfs_emit(buf, "%u\n", READ_ONCE(*val));
+}
+
+static ssize_t spi_store_u32(struct device *d, const char *buf, size_t count, u32 *val, u32 max){
+	u32 tmp;
+	int ret = kstrtou32(buf, 0, &tmp);
+
+	if (ret)
+		return ret;
+	if (tmp > max)
+		return -EINVAL;
+	WRITE_ONCE(*val, tmp);
+	return count;
+}
+
+#define SPI_POLL_ATTR(name, max)								\
+static ssize_t name##_show(struct device *d, struct device_attribute *attr, char *buf){		\
+	return spi_show_u32(d, buf, &((struct spi_dev *)dev_get_drvdata(d))->name);		\
+}												\
+static ssize_t name##_store(struct device *d, struct device_attribute *attr,			\
+			    const char *buf, size_t count){					\
+	return spi_store_u32(d, buf, count, &((struct spi_dev *)dev_get_drvdata(d))->name, max);	\
+}												\
+static DEVICE_ATTR_RW(name)
+
+SPI_POLL_ATTR(poll_mode, SPI_POLL_ADAPTIVE);
+SPI_POLL_ATTR(poll_budget_ns, NSEC_PER_MSEC);
+SPI_POLL_ATTR(poll_max_ns, NSEC_PER_MSEC);
+
+static ssize_t poll_stats_show(struct device *d, struct device_attribute *attr, char *buf){
+	struct spi_dev *dev = dev_get_drvdata(d);
+
+	return sysfs_emit(buf, "hits %lu misses %lu irq_waits %lu ns_per_word %lu\n",
+			  dev->poll_hits, dev->poll_misses, dev->irq_waits,
+			  ewma_spi_word_read(&dev->ns_per_word));
+}
+static DEVICE_ATTR_RO(poll_stats);
+
+static struct attribute *spi_attrs[] = {
+	&dev_attr_poll_mode.attr,
+	&dev_attr_poll_budget_ns.attr,
+	&dev_attr_poll_max_ns.attr,
+	&dev_attr_poll_stats.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(spi);
+
 static struct platform_driver spi_driver = {
 	.probe = spi_probe,
 	.remove = spi_remove,
 	.driver = {
-		.name = DRIVER_NAME,  
+		.name = DRIVER_NAME,
 		.owner = THIS_MODULE,
+		.of_match_table = spi_dt_ids,
+		.dev_groups = spi_groups,
 	},
 };
 /*---------------------------------------------------------------------------*/
+//24 bit frames are 3 bytes in the user buffer and one FIFO entry each
+static void spi_unpack24(u32 *buf, unsigned int n){
+	const u8 *src = (const u8 *)buf;
+	unsigned int i;
+
+	//Back to front, so each entry is built before its bytes get overwritten
+	for (i = n; i--; )
+		buf[i] = src[3 * i] | src[3 * i + 1] << 8 | src[3 * i + 2] << 16;
+}
+
+static void spi_pack24(u32 *buf, unsigned int n){
+	u8 *dst = (u8 *)buf;
+	unsigned int i;
+	u32 word;
+
+	for (i = 0; i < n; i++) {
+		word = buf[i];
+		dst[3 * i] = word;
+		dst[3 * i + 1] = word >> 8;
+		dst[3 * i + 2] = word >> 16;
+	}
+}
+
+//A ragged tail of 8 or 16 bit frames goes out unpacked, one frame per entry
+static void spi_unpack_tail(u32 *buf, unsigned int n, unsigned int frame){
+	unsigned int i;
+
+	for (i = n; i--; )
+		buf[i] = frame == 1 ? ((u8 *)buf)[i] : ((u16 *)buf)[i];
+}
+
+static void spi_pack_tail(u32 *buf, unsigned int n, unsigned int frame){
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (frame == 1)
+			((u8 *)buf)[i] = buf[i];
+		else
+			((u16 *)buf)[i] = buf[i];
+	}
+}
+
+/*Streams len bytes through the FIFOs as frames of misc_bpw bits, one FIFO
+ *depth per burst. A write() clocks the user buffer out and drops what comes
+ *back, a read() clocks zeros out and hands the RX frames to the user.
+ *
+ *Each width has its own layout so every register access carries as much
+ *payload as the core allows: 8 and 16 bit frames travel packed 4 and 2 per
+ *entry straight from the user buffer, 24 bit frames are expanded from 3 bytes
+ *to one entry, 32 bit frames are copied as they are. At 32 bits the tail of
+ *a buffer that isn't a whole word is zero padded on the wire, other widths
+ *only move whole frames.*/
+static ssize_t spi_stream(struct spi_dev *dev, char __user *ubuf, size_t len, bool is_read)
+{
+	unsigned int bpw = READ_ONCE(dev->misc_bpw), frame = bpw / 8;
+	size_t done = 0, left, chunk;
+	unsigned int nwords;
+	bool tail, trace = spi_trace_on(dev);
+	u64 start = trace ? ktime_get_ns() : 0;
+	u32 crc = ~0, payload_max = 0;
+	u8 *payload = NULL;
+	int ret = 0;
+
+	if (bpw != 32)
+		len -= len % frame;
+	//Nothing left once rounded down to whole frames, like a zero length read()
+	if (len == 0)
+		return 0;
+
+	//Captured from the bursts as they go out, the user buffer may change under us
+	if (trace && !is_read) {
+		payload_max = min_t(size_t, len, READ_ONCE(dev->trace.payload_max));
+		if (payload_max)
+			payload = kmalloc(payload_max, GFP_KERNEL);
+	}
+
+	mutex_lock(&dev->lock);
+	spi_qos_get(dev);
+	spi_set_width(dev, bpw - 1);
+
+	while (done < len) {
+		//A killed process doesn't wait out the rest of a long buffer
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		left = len - done;
+		tail = false;
+		if (bpw == 24) {
+			nwords = min_t(size_t, left / 3, dev->fifo_depth);
+			chunk = nwords * 3;
+		} else if (bpw == 32) {
+			chunk = min_t(size_t, left, dev->fifo_depth * sizeof(u32));
+			nwords = DIV_ROUND_UP(chunk, sizeof(u32));
+		} else if (left < sizeof(u32)) {
+			tail = true;
+			chunk = left;
+			nwords = left / frame;
+		} else {
+			nwords = min_t(size_t, left / sizeof(u32), dev->fifo_depth);
+			chunk = nwords * sizeof(u32);
+		}
+		spi_set_pack(dev, spi_can_pack(bpw) && !tail);
+
+		if (is_read) {
+			memset(dev->burst, 0, nwords * sizeof(u32));
+		} else {
+			dev->burst[nwords - 1] = 0;
+			if (copy_from_user(dev->burst, ubuf + done, chunk)) {
+				ret = -EFAULT;
+				break;
+			}
+			if (trace)
+				crc = crc32_le(crc, (u8 *)dev->burst, chunk);
+			if (payload && done < payload_max)
+				memcpy(payload + done, dev->burst, min_t(size_t, chunk, payload_max - done));
+			if (bpw == 24)
+				spi_unpack24(dev->burst, nwords);
+			else if (tail)
+				spi_unpack_tail(dev->burst, nwords, frame);
+		}
+
+		spi_writesl(dev, FPGA_SPI_TXDATA, dev->burst, nwords);
+		ret = spi_wait_burst(dev, nwords);
+		if (ret)
+			break;
+		spi_readsl(dev, FPGA_SPI_RXDATA, dev->burst, nwords);
+
+		if (is_read) {
+			if (bpw == 24)
+				spi_pack24(dev->burst, nwords);
+			else if (tail)
+				spi_pack_tail(dev->burst, nwords, frame);
+			if (copy_to_user(ubuf + done, dev->burst, chunk)) {
+				ret = -EFAULT;
+				break;
+			}
+		}
+		done += chunk;
+	}
+
+	spi_qos_put(dev);
+	mutex_unlock(&dev->lock);
+
+	if (done) {
+		lkm_pmu_add(LKM_PMU_SPI_XFERS, 1);
+		lkm_pmu_add(LKM_PMU_SPI_BYTES, done);
+		if (trace)
+			spi_trace_stream(dev, payload, min_t(size_t, done, payload_max), done, is_read, bpw,
+					 start, crc);
+	}
+	kfree(payload);
+
+	// Report partial progress so the caller knows how much actually went over the wire
+	return done ? done : ret;
+}
+
+//Open Operation
+static int spi_open(struct inode *inode, struct file *file)
+{
+	struct spi_dev *dev = container_of(file->private_data, struct spi_dev, miscdev);
+	struct spi_file *sf;
+
+	sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+	if (sf == NULL)
+		return -ENOMEM;
+	sf->dev = dev;
+
+	//A real-time client's transfers shouldn't wait on an idle exit, not even the first one
+	sf->rt = rt_task(current);
+	if (sf->rt)
+		spi_qos_get(dev);
+
+	file->private_data = sf;
+	return 0;
+}
+
+//Release Operation
+static int spi_release(struct inode *inode, struct file *file)
+{
+	struct spi_file *sf = file->private_data;
+
+	if (sf->rt)
+		spi_qos_put(sf->dev);
+	kfree(sf);
+	return 0;
+}
+
 //Read Operation
 static ssize_t spi_read(struct file *file, char *buffer, size_t len, loff_t *offset)
 {
-    int success = 0;
-    
-    struct spi_dev *dev = container_of(file->private_data, struct spi_dev, miscdev);
-    
-    // Give the user the current led value
-    success = copy_to_user(buffer, &dev->spi_value, sizeof(dev->spi_value));
-
-    // If we failed to copy the value to userspace, display an error message
-    if(success != 0) {
-        pr_info("Failed to return current spi value to userspace\n");
-        return -EFAULT; // Bad address error value. It's likely that "buffer" doesn't point to a good address
-    }
+	struct spi_dev *dev = ((struct spi_file *)file->private_data)->dev;
 
-    return 0; // "0" indicates End of File, aka, it tells the user process to stop reading
+	return spi_stream(dev, (char __user *)buffer, len, true);
 }
 //Write Operation
 static ssize_t spi_write(struct file *file, const char *buffer, size_t len, loff_t *offset)
 {
-    int success = 0;
+	struct spi_dev *dev = ((struct spi_file *)file->private_data)->dev;
 
-    struct spi_dev *dev = container_of(file->private_data, struct spi_dev, miscdev);
+	return spi_stream(dev, (char __user *)buffer, len, false);
+}
+
+//Rejects a program before anything touches the hardware, returns the number of reads
+static int spi_check_program(struct spi_dev *dev, const struct platform_spi_op *ops, u32 nops)
+{
+	int nreads = 0;
+	u32 i;
 
-    // Get the new led value (this is just the first byte of the given data)
-    success = copy_from_user(&dev->spi_value, buffer, sizeof(dev->spi_value));
+	for (i = 0; i < nops; i++) {
+		if (ops[i].op != PLATFORM_SPI_OP_DELAY &&
+			(!IS_ALIGNED(ops[i].reg, sizeof(u32)) || ops[i].reg >= dev->regs_size))
+			return -EINVAL;
 
-    // If we failed to copy the value from userspace, display an error message
-    if(success != 0) {
-        pr_info("Failed to read led value from userspace\n");
-        return -EFAULT; // Bad address error value. It's likely that "buffer" doesn't point to a good address
-    } else {
-        // We read the data correctly, so update the LEDs
-        iowrite32(dev->spi_value, dev->regs);
-    }
+		switch (ops[i].op) {
+		case PLATFORM_SPI_OP_READ:
+			nreads++;
+			break;
+		case PLATFORM_SPI_OP_WRITE:
+		case PLATFORM_SPI_OP_MASKED_WRITE:
+			break;
+		case PLATFORM_SPI_OP_POLL:
+			//read_poll_timeout() takes 0 as no timeout at all, under dev->lock
+			if (ops[i].timeout_us == 0 || ops[i].timeout_us > SPI_XFER_TIMEOUT_US)
+				return -EINVAL;
+			break;
+		case PLATFORM_SPI_OP_DELAY:
+			if (ops[i].val > SPI_PROG_MAX_DELAY_US)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
 
-    return len; // Tell the user process that we wrote every byte they sent (even if we only wrote the first value, this will ensure they don't try to re-write their data)
+	return nreads;
+}
+
+/*Runs a checked program against the register window. The device lock keeps
+ *controller messages off the core for the whole program. Returns 0 or the
+ *error of the op that failed, *executed counts the ops that completed.*/
+static int spi_exec_program(struct spi_dev *dev, const struct platform_spi_op *ops, u32 nops,
+							u32 *results, u32 *executed)
+{
+	const struct platform_spi_op *op;
+	u32 i, val, nreads = 0;
+	int ret = 0;
+
+	mutex_lock(&dev->lock);
+	spi_qos_get(dev);
+	for (i = 0; i < nops && !ret; i++) {
+		op = &ops[i];
+		switch (op->op) {
+		case PLATFORM_SPI_OP_READ:
+			results[nreads++] = spi_readl(dev, op->reg);
+			break;
+		case PLATFORM_SPI_OP_WRITE:
+			spi_writel(dev, op->reg, op->val);
+			break;
+		case PLATFORM_SPI_OP_MASKED_WRITE:
+			val = spi_readl(dev, op->reg);
+			spi_writel(dev, op->reg, (val & ~op->mask) | (op->val & op->mask));
+			break;
+		case PLATFORM_SPI_OP_POLL:
+			ret = read_poll_timeout(spi_readl, val, (val & op->mask) == op->val, 0,
+									op->timeout_us, false, dev, op->reg);
+			break;
+		case PLATFORM_SPI_OP_DELAY:
+			fsleep(op->val);
+			break;
+		}
+		if (!ret)
+			*executed = i + 1;
+	}
+	//The program may have written anything
+	spi_reload_shadows(dev);
+	spi_qos_put(dev);
+	mutex_unlock(&dev->lock);
+
+	return ret;
+}
+
+static long spi_run_program(struct spi_dev *dev, struct platform_spi_program __user *uprog)
+{
+	struct platform_spi_program prog;
+	struct platform_spi_op *ops;
+	u32 *results = NULL;
+	int nreads, ret;
+
+	if (copy_from_user(&prog, uprog, sizeof(prog)))
+		return -EFAULT;
+	if (prog.nops == 0 || prog.nops > PLATFORM_SPI_PROG_MAX_OPS)
+		return -EINVAL;
+
+	ops = memdup_user(u64_to_user_ptr(prog.ops), prog.nops * sizeof(*ops));
+	if (IS_ERR(ops))
+		return PTR_ERR(ops);
+
+	nreads = spi_check_program(dev, ops, prog.nops);
+	if (nreads < 0) {
+		ret = nreads;
+		goto out;
+	}
+	if (nreads) {
+		results = kcalloc(nreads, sizeof(u32), GFP_KERNEL);
+		if (results == NULL) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	prog.executed = 0;
+	ret = spi_exec_program(dev, ops, prog.nops, results, &prog.executed);
+
+	//Whatever was read before a failure is still handed back
+	if (nreads && copy_to_user(u64_to_user_ptr(prog.results), results, nreads * sizeof(u32)))
+		ret = -EFAULT;
+	if (put_user(prog.executed, &uprog->executed))
+		ret = -EFAULT;
+
+out:
+	kfree(results);
+	kfree(ops);
+	return ret;
+}
+
+//Ioctl Operation
+static long spi_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct spi_dev *dev = ((struct spi_file *)file->private_data)->dev;
+	u8 bpw;
+
+	switch (cmd) {
+	case PLATFORM_SPI_IOC_RD_BITS_PER_WORD:
+		return put_user((u8)READ_ONCE(dev->misc_bpw), (u8 __user *)arg);
+	case PLATFORM_SPI_IOC_WR_BITS_PER_WORD:
+		if (get_user(bpw, (u8 __user *)arg))
+			return -EFAULT;
+		if (bpw != 8 && bpw != 16 && bpw != 24 && bpw != 32)
+			return -EINVAL;
+		//Taken so a stream in progress keeps the width it started with
+		mutex_lock(&dev->lock);
+		WRITE_ONCE(dev->misc_bpw, bpw);
+		mutex_unlock(&dev->lock);
+		return 0;
+	case PLATFORM_SPI_IOC_RUN:
+		return spi_run_program(dev, (struct platform_spi_program __user *)arg);
+	default:
+		return -ENOTTY;
+	}
 }
 
 
 //Basic functions for insmod and rmmod userspace calls
 static int __init spi_init(void){
+	int ret;
+
 	pr_info("\n Welcome to the spi platform driver...\n");
-	return platform_driver_register(&spi_driver);
+	spi_debugfs_root = debugfs_create_dir(DRIVER_NAME, NULL);
+	//perf counters when lkm_pmu is loaded, attached before probe can count
+	lkm_pmu_attach();
+	ret = platform_driver_register(&spi_driver);
+	if (ret) {
+		lkm_pmu_detach();
+		debugfs_remove_recursive(spi_debugfs_root);
+	}
+	return ret;
 }
 
-static int __exit spi_exit(void){
+static void __exit spi_exit(void){
 	pr_info("\n Unloading spi platform driver...\n");
 	platform_driver_unregister(&spi_driver);
+	debugfs_remove_recursive(spi_debugfs_root);
+	lkm_pmu_detach();
 }
 
 //Mandatory function calls - must be included in every KLM
@@ -165,4 +1738,3 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Brad Turcott <bturcott@altera.com>");
 MODULE_DESCRIPTION("A component SPI driver on the platform bus.");
 MODULE_VERSION("1.0");
-
@@ -0,0 +1,261 @@
+/*
+ *@file spi_replay.c
+ *@author Brad Turcott
+ *@brief Replays a platform_spi transaction capture through /dev/spi and
+ * compares the replay against the capture.
+ *
+ * Capture on the target:
+ *   echo 4096 > /sys/kernel/debug/platform_spi/<device>/capture_payload
+ *   echo 1 > /sys/kernel/debug/platform_spi/<device>/capture
+ *   ...production traffic...
+ *   cat /sys/kernel/debug/platform_spi/<device>/trace > traffic.trace
+ *
+ * Replay, at the captured pace or with -f back to back:
+ *   spi_replay [-d /dev/spi] [-f] [-n loops] traffic.trace
+ *
+ * Every record is re-issued as a write() of its TX data, the captured payload
+ * followed by zeros past payload_len, or as a read() when it had no TX data.
+ * Frame widths the misc device lacks go out as the next wider one that keeps
+ * the buffer layout. Captured times are from the start of a transfer to its
+ * end in the driver, replayed ones around the system call, so the replay also
+ * pays for the syscall and the copies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "platform_spi_ioctl.h"
+
+struct replay_stats {
+	uint64_t bytes;
+	uint64_t span_ns; //first start to last end
+	uint64_t busy_ns; //sum of durations
+	uint64_t *lat; //per record, ns
+	uint64_t late_ns, late_max_ns; //paced replay only, start behind schedule
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = { .tv_sec = t / 1000000000ull, .tv_nsec = t % 1000000000ull };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+//Buffer layout of an spi_transfer maps onto 8, 16 or 32 bit misc frames
+static uint8_t misc_bpw(uint8_t bpw)
+{
+	if (bpw <= 8)
+		return 8;
+	if (bpw <= 16)
+		return 16;
+	return 32;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+//p in percent, lat gets sorted
+static uint64_t percentile(uint64_t *lat, size_t n, unsigned int p)
+{
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+	return lat[(n - 1) * p / 100];
+}
+
+static void print_row(const char *name, double cap, double rep)
+{
+	printf("%-18s %14.3f %14.3f %+9.1f%%\n", name, cap, rep, cap ? (rep - cap) * 100 / cap : 0.0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d device] [-f] [-n loops] trace\n"
+		"  -d  misc device to replay through, default /dev/spi\n"
+		"  -f  back to back instead of at the captured pace\n"
+		"  -n  replay the trace this many times, default 1\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *devname = "/dev/spi";
+	struct platform_spi_trace_rec **recs = NULL, *rec;
+	struct replay_stats cap = { 0 }, rep = { 0 };
+	size_t size = 0, off, nrecs = 0, n, i;
+	uint32_t maxlen = 0, loops = 1, loop;
+	uint64_t start, t0, begin, end;
+	uint8_t cur_bpw = 0, bpw;
+	int fast = 0, opt, fd;
+	unsigned char *trace = NULL, *buf;
+	ssize_t ret;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "d:fn:")) != -1) {
+		switch (opt) {
+		case 'd':
+			devname = optarg;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || loops == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	//The trace comes from debugfs through cat, so just slurp it
+	f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	for (;;) {
+		trace = realloc(trace, size + 65536);
+		if (trace == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		n = fread(trace + size, 1, 65536, f);
+		size += n;
+		if (n < 65536)
+			break;
+	}
+	fclose(f);
+
+	for (off = 0; off + sizeof(*rec) <= size; off += sizeof(*rec) + ((rec->payload_len + 7) & ~7u)) {
+		rec = (struct platform_spi_trace_rec *)(trace + off);
+		if (rec->payload_len > rec->len || off + sizeof(*rec) + rec->payload_len > size) {
+			fprintf(stderr, "Truncated or corrupt record at offset %zu\n", off);
+			break;
+		}
+		recs = realloc(recs, (nrecs + 1) * sizeof(*recs));
+		if (recs == NULL) {
+			perror("realloc");
+			return 1;
+		}
+		recs[nrecs++] = rec;
+		if (rec->len > maxlen)
+			maxlen = rec->len;
+	}
+	if (nrecs == 0) {
+		fprintf(stderr, "No records in %s\n", argv[optind]);
+		return 1;
+	}
+
+	buf = malloc(maxlen ? maxlen : 1);
+	cap.lat = calloc(nrecs, sizeof(uint64_t));
+	rep.lat = calloc(nrecs * loops, sizeof(uint64_t));
+	if (buf == NULL || cap.lat == NULL || rep.lat == NULL) {
+		perror("malloc");
+		return 1;
+	}
+
+	for (i = 0; i < nrecs; i++) {
+		cap.bytes += recs[i]->len;
+		cap.busy_ns += recs[i]->duration_ns;
+		cap.lat[i] = recs[i]->duration_ns;
+	}
+	cap.span_ns = recs[nrecs - 1]->timestamp_ns + recs[nrecs - 1]->duration_ns - recs[0]->timestamp_ns;
+
+	fd = open(devname, O_RDWR);
+	if (fd < 0) {
+		perror(devname);
+		return 1;
+	}
+
+	start = now_ns();
+	for (loop = 0, n = 0; loop < loops; loop++) {
+		t0 = now_ns();
+		for (i = 0; i < nrecs; i++, n++) {
+			rec = recs[i];
+
+			bpw = misc_bpw(rec->bits_per_word);
+			if (bpw != cur_bpw) {
+				if (ioctl(fd, PLATFORM_SPI_IOC_WR_BITS_PER_WORD, &bpw) < 0) {
+					perror("PLATFORM_SPI_IOC_WR_BITS_PER_WORD");
+					return 1;
+				}
+				cur_bpw = bpw;
+			}
+
+			if (!fast) {
+				begin = t0 + (rec->timestamp_ns - recs[0]->timestamp_ns);
+				end = now_ns();
+				if (end > begin) {
+					rep.late_ns += end - begin;
+					if (end - begin > rep.late_max_ns)
+						rep.late_max_ns = end - begin;
+				} else {
+					sleep_until(begin);
+				}
+			}
+
+			if (rec->flags & PLATFORM_SPI_TRACE_TX) {
+				memcpy(buf, rec + 1, rec->payload_len);
+				memset(buf + rec->payload_len, 0, rec->len - rec->payload_len);
+			}
+			begin = now_ns();
+			if (rec->flags & PLATFORM_SPI_TRACE_TX)
+				ret = write(fd, buf, rec->len);
+			else
+				ret = read(fd, buf, rec->len);
+			end = now_ns();
+			if (ret < 0) {
+				fprintf(stderr, "Record %zu: %s\n", i, strerror(errno));
+				return 1;
+			}
+
+			rep.bytes += ret;
+			rep.busy_ns += end - begin;
+			rep.lat[n] = end - begin;
+		}
+	}
+	rep.span_ns = now_ns() - start;
+	close(fd);
+
+	printf("%zu records, %u loop(s), %s\n\n", nrecs, loops, fast ? "back to back" : "captured pace");
+	printf("%-18s %14s %14s %10s\n", "", "captured", "replayed", "delta");
+	print_row("span ms", cap.span_ns / 1e6, rep.span_ns / 1e6 / loops);
+	print_row("MB/s over span", cap.bytes * 1e3 / cap.span_ns, rep.bytes * 1e3 / rep.span_ns);
+	print_row("MB/s while busy", cap.bytes * 1e3 / cap.busy_ns, rep.bytes * 1e3 / rep.busy_ns);
+	print_row("latency mean us", cap.busy_ns / 1e3 / nrecs, rep.busy_ns / 1e3 / n);
+	print_row("latency p50 us", percentile(cap.lat, nrecs, 50) / 1e3, percentile(rep.lat, n, 50) / 1e3);
+	print_row("latency p99 us", percentile(cap.lat, nrecs, 99) / 1e3, percentile(rep.lat, n, 99) / 1e3);
+	print_row("latency max us", cap.lat[nrecs - 1] / 1e3, rep.lat[n - 1] / 1e3);
+	if (!fast)
+		printf("\nstarts behind schedule: mean %.1f us, max %.1f us\n",
+		       rep.late_ns / 1e3 / n, rep.late_max_ns / 1e3);
+
+	free(rep.lat);
+	free(cap.lat);
+	free(buf);
+	free(recs);
+	free(trace);
+	return 0;
+}
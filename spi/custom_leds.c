@@ -5,6 +5,11 @@
 #include <linux/fs.h>
 #include <linux/types.h>
 #include <linux/uaccess.h>
+#include <linux/debugfs.h>
+
+#include "fpga_sim.h"
+#include "reg_prof.h"
+#include "lkm_pmu.h"
 
 // Prototypes
 static int leds_probe(struct platform_device *pdev);
@@ -16,9 +21,30 @@ static ssize_t leds_write(struct file *file, const char *buffer, size_t len, lof
 struct custom_leds_dev {
     struct miscdevice miscdev;
     void __iomem *regs;
+    const struct fpga_sim_ops *sim; // Register model from fpga_sim, NULL on real hardware
     u8 leds_value;
+    struct dentry *debugfs;
+    struct reg_prof prof; // Register access counts, built with REG_PROF=y
 };
 
+// Holds one directory per LED device, for the register profile
+static struct dentry *leds_debugfs_root;
+
+static const char *const leds_reg_names[REG_PROF_REGS] = { "LEDS" };
+
+// Every write to the LED register goes through here
+static void leds_writel(struct custom_leds_dev *dev, u32 val)
+{
+    struct reg_prof_sample s = reg_prof_begin(&dev->prof);
+
+    if (dev->sim)
+        dev->sim->writel(dev->sim->priv, 0, val);
+    else
+        iowrite32(val, dev->regs);
+    reg_prof_end(&dev->prof, s, 0, REG_PROF_WRITE);
+    lkm_pmu_add(LKM_PMU_LED_WRITES, 1);
+}
+
 // Specify which device tree devices this driver supports
 static struct of_device_id custom_leds_dt_ids[] = {
     {
@@ -54,10 +80,16 @@ static int leds_init(void)
     int ret_val = 0;
     pr_info("Initializing the Custom LEDs module\n");
 
+    leds_debugfs_root = debugfs_create_dir("custom_leds", NULL);
+    // Count register writes for perf if lkm_pmu is loaded, probe may already write
+    lkm_pmu_attach();
+
     // Register our driver with the "Platform Driver" bus
     ret_val = platform_driver_register(&leds_platform);
     if(ret_val != 0) {
         pr_err("platform_driver_register returned %d\n", ret_val);
+        lkm_pmu_detach();
+        debugfs_remove_recursive(leds_debugfs_root);
         return ret_val;
     }
 
@@ -76,26 +108,32 @@ static int leds_probe(struct platform_device *pdev)
     
     pr_info("leds_probe enter\n");
 
-    // Get the memory resources for this LED device
-    r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-    if(r == NULL) {
-        pr_err("IORESOURCE_MEM (register space) does not exist\n");
-        goto bad_exit_return;
-    }
-    
     // Create structure to hold device-specific information (like the registers)
     dev = devm_kzalloc(&pdev->dev, sizeof(struct custom_leds_dev), GFP_KERNEL);
-
-    // Both request and ioremap a memory region
-    // This makes sure nobody else can grab this memory region
-    // as well as moving it into our address space so we can actually use it
-    dev->regs = devm_ioremap_resource(&pdev->dev, r);
-    if(IS_ERR(dev->regs))
-        goto bad_ioremap;
+    if(dev == NULL)
+        return -ENOMEM;
+
+    // The fpga_sim module passes a register model instead of a memory resource
+    dev->sim = dev_get_platdata(&pdev->dev);
+    if(dev->sim == NULL) {
+        // Get the memory resources for this LED device
+        r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
+        if(r == NULL) {
+            pr_err("IORESOURCE_MEM (register space) does not exist\n");
+            goto bad_exit_return;
+        }
+
+        // Both request and ioremap a memory region
+        // This makes sure nobody else can grab this memory region
+        // as well as moving it into our address space so we can actually use it
+        dev->regs = devm_ioremap_resource(&pdev->dev, r);
+        if(IS_ERR(dev->regs))
+            goto bad_ioremap;
+    }
 
     // Turn the LEDs on (access the 0th register in the custom LEDs module)
     dev->leds_value = 0xFF;
-    iowrite32(dev->leds_value, dev->regs);
+    leds_writel(dev, dev->leds_value);
 
     // Initialize the misc device (this is used to create a character file in userspace)
     dev->miscdev.minor = MISC_DYNAMIC_MINOR;    // Dynamically choose a minor number
@@ -112,6 +150,10 @@ static int leds_probe(struct platform_device *pdev)
     // so we can access this data later on (for instance, in the read and write functions)
     platform_set_drvdata(pdev, (void*)dev);
 
+    // Profile under <debugfs>/custom_leds/<device>/, failing only loses the statistics
+    dev->debugfs = debugfs_create_dir(dev_name(&pdev->dev), leds_debugfs_root);
+    reg_prof_init(&dev->prof, &pdev->dev, dev->debugfs, leds_reg_names);
+
     pr_info("leds_probe exit\n");
 
     return 0;
@@ -180,7 +222,7 @@ static ssize_t leds_write(struct file *file, const char *buffer, size_t len, lof
         return -EFAULT; // Bad address error value. It's likely that "buffer" doesn't point to a good address
     } else {
         // We read the data correctly, so update the LEDs
-        iowrite32(dev->leds_value, dev->regs);
+        leds_writel(dev, dev->leds_value);
     }
 
     return len; // Tell the user process that we wrote every byte they sent (even if we only wrote the first value, this will ensure they don't try to re-write their data)
@@ -196,8 +238,10 @@ static int leds_remove(struct platform_device *pdev)
 
     pr_info("leds_remove enter\n");
 
+    debugfs_remove_recursive(dev->debugfs);
+
     // Turn the LEDs off
-    iowrite32(0x00, dev->regs);
+    leds_writel(dev, 0x00);
 
     // Unregister the character file (remove it from /dev)
     misc_deregister(&dev->miscdev);
@@ -215,6 +259,8 @@ static void leds_exit(void)
     // Unregister our driver from the "Platform Driver" bus
     // This will cause "leds_remove" to be called for each connected device
     platform_driver_unregister(&leds_platform);
+    debugfs_remove_recursive(leds_debugfs_root);
+    lkm_pmu_detach();
 
     pr_info("Custom LEDs module successfully unregistered\n");
 }
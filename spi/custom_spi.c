@@ -2,8 +2,10 @@
  * @file   custom_spi.c
  * @author Brad Turcott
  * @date   11-23-2015
- * @version 0.1
- * @brief   An introductory character driver designed to interface with a custom spi in the FPGA fabric.
+ * @version 0.2
+ * @brief   A character driver for peripherals hanging off the custom spi in the FPGA fabric.
+ * It binds to spi devices on the controller registered by platform_spi and speaks the same
+ * ioctl interface as spidev, so existing spidev userspace works unchanged against /dev/custom_spiB.C
  */
 #include <linux/init.h>
 #include <linux/module.h>
@@ -15,161 +17,757 @@
 #include <linux/errno.h>
 #include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/mempool.h>
 #include <linux/compat.h>
 #include <linux/of.h>
 #include <linux/of_device.h>
+#include <linux/uaccess.h>
 
 #include <linux/spi/spi.h>
 #include <linux/spi/spidev.h>
 
-#define  DEVICE_NAME "custom_spi"    ///< The device will appear at /dev/ebbchar using this value
-#define  CLASS_NAME  "spi"        ///< The device class -- this is a character device driver
- 
+#define  DEVICE_NAME "custom_spi"    ///< The device will appear at /dev/custom_spiB.C using this value
+#define  CLASS_NAME  "custom_spi"    ///< The device class -- this is a character device driver
+#define  N_SPI_MINORS 32             ///< Number of spi devices this driver can serve at once
+#define  POOL_XFERS 16               ///< Segments of a message served from the descriptor pool
+
 MODULE_LICENSE("GPL");            ///< The license type -- this affects available functionality
 MODULE_AUTHOR("Brad Turcott");    ///< The author -- visible when you use modinfo
 MODULE_DESCRIPTION("A spi Linux component driver for the Atlas");  ///< The description -- see modinfo
-MODULE_VERSION("0.1");            ///< A version number to inform users
- 
+MODULE_VERSION("0.2");            ///< A version number to inform users
+
+static unsigned int bufsiz = 4096;            ///< Largest message (summed over all segments) in bytes
+module_param(bufsiz, uint, S_IRUGO);
+MODULE_PARM_DESC(bufsiz, "data bytes in biggest supported SPI message");
+
+static unsigned int pool_reserve = 2;         ///< Message descriptors set aside per device at probe
+module_param(pool_reserve, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_reserve, "message descriptors reserved per spi device");
+
+/** @brief The segments of one SPI_IOC_MESSAGE(N) as copied from userspace and as handed to the
+ *  spi core. Messages of up to POOL_XFERS segments use a pool element with the arrays inline, so
+ *  the ioctl path doesn't allocate; longer ones get a kmalloc of the exact size.
+ */
+struct custom_spi_msg {
+   bool                    pooled;
+   struct spi_transfer     *k_xfers;     ///< Follows u_xfers
+   struct spi_ioc_transfer u_xfers[];
+};
+
+#define POOL_MSG_SIZE (sizeof(struct custom_spi_msg) + \
+                       POOL_XFERS * (sizeof(struct spi_ioc_transfer) + sizeof(struct spi_transfer)))
+
+static struct kmem_cache *msg_cache;        ///< Backs every device's msg_pool
+
+/** @brief Mode bits userspace is allowed to change with SPI_IOC_WR_MODE(32) */
+#define SPI_MODE_MASK (SPI_CPHA | SPI_CPOL | SPI_CS_HIGH | SPI_LSB_FIRST | SPI_3WIRE | SPI_LOOP \
+                       | SPI_NO_CS | SPI_READY | SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD)
+
+/** @brief The settings a client asked for with the SPI_IOC_WR_* ioctls. Each open file has its
+ *  own, so clients sharing a device don't see each other's changes. mode and bits_per_word are
+ *  pushed to the spi device with spi_setup() only when they differ from what is already applied,
+ *  speed_hz goes with every transfer and the controller caches its divider.
+ */
+struct custom_spi_profile {
+   u32               mode;          ///< SPI_MODE_MASK bits only
+   u32               speed_hz;      ///< Default speed for segments that don't set one
+   u8                bits_per_word;
+};
+
+/** @brief One instance per spi device bound to this driver */
+struct custom_spi_data {
+   dev_t             devt;
+   spinlock_t        spi_lock;      ///< Protects spi against unbind while a file is open
+   struct spi_device *spi;
+   struct list_head  device_entry;
+   struct mutex      buf_lock;      ///< Serialises users of the bounce buffers
+   unsigned int      users;
+   u8                *tx_buffer;
+   u8                *rx_buffer;
+   struct custom_spi_profile applied; ///< mode and bits_per_word the spi device is set up with
+   mempool_t         *msg_pool;     ///< pool_reserve message descriptors out of msg_cache
+};
+
+/** @brief Per open file state */
+struct custom_spi_file {
+   struct custom_spi_data    *data;
+   struct custom_spi_profile prof;
+};
+
 static int    majorNumber;                  ///< Stores the device number -- determined automatically
 static int    numberOpens = 0;              ///< Counts the number of times the device is opened
+static DECLARE_BITMAP(minors, N_SPI_MINORS); ///< Minor numbers handed out to bound devices
+static LIST_HEAD(device_list);              ///< Every custom_spi_data, looked up by devt on open
 
 static struct class*  custom_spiClass  = NULL; ///< The device-driver class struct pointer
-static struct device* custom_spiDevice = NULL; ///< The device-driver device struct pointer
-static DEFINE_MUTEX(custom_spi_mutex); //Added for mutex lock functionality
+static DEFINE_MUTEX(custom_spi_mutex); ///< Protects device_list, minors and the users counts
+
 // The prototype functions for the character driver -- must come before the struct definition
+static int     dev_open(struct inode *, struct file *);
+static int     dev_release(struct inode *, struct file *);
+static ssize_t dev_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t dev_write(struct file *, const char __user *, size_t, loff_t *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
 
- 
 /** @brief Devices are represented as file structure in the kernel. The file_operations structure from
  *  /linux/fs.h lists the callback functions that you wish to associated with your file operations
- *  using a C99 syntax structure. char devices usually implement open, read, write and release calls
+ *  using a C99 syntax structure. The ioctl layout matches spidev so compat_ptr_ioctl is enough.
  */
-static struct file_operations fops =
+static const struct file_operations fops =
 {
+   .owner = THIS_MODULE,
    .open = dev_open,
    .read = dev_read,
    .write = dev_write,
+   .unlocked_ioctl = dev_ioctl,
+   .compat_ioctl = compat_ptr_ioctl,
    .release = dev_release,
+   .llseek = no_llseek,
 };
- 
-/** @brief The LKM initialization function
- *  The static keyword restricts the visibility of the function to within this C file. The __init
- *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
- *  time and that it can be discarded and its memory freed up after that point.
- *  @return returns 0 if successful
+
+/** @brief Sets the spi device up for a profile unless it already is. Interleaved clients with
+ *  the same settings, the common case, then cost no spi_setup() and no register writes at all.
+ *  @param data The custom_spi instance, buf_lock held
+ *  @param spi Its spi device
+ *  @param prof The profile to apply
+ *  @return 0 or the error of spi_setup(), in which case the previous settings stay
  */
-static int __init ebbchar_init(void){
-   printk(KERN_INFO "EBBChar: Initializing the EBBChar LKM\n");
- 
-   // Try to dynamically allocate a major number for the device -- more difficult but worth it
-   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
-   if (majorNumber<0){
-      printk(KERN_ALERT "EBBChar failed to register a major number\n");
-      return majorNumber;
-   }
-   printk(KERN_INFO "EBBChar: registered correctly with major number %d\n", majorNumber);
- 
-   // Register the device class
-   ebbcharClass = class_create(THIS_MODULE, CLASS_NAME);
-   if (IS_ERR(ebbcharClass)){                // Check for error and clean up if there is
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to register device class\n");
-      return PTR_ERR(ebbcharClass);          // Correct way to return an error on a pointer
-   }
-   printk(KERN_INFO "EBBChar: device class registered correctly\n");
- 
-   // Register the device driver
-   ebbcharDevice = device_create(ebbcharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
-   if (IS_ERR(ebbcharDevice)){               // Clean up if there is an error
-      class_destroy(ebbcharClass);           // Repeated code but the alternative is goto statements
-      unregister_chrdev(majorNumber, DEVICE_NAME);
-      printk(KERN_ALERT "Failed to create the device\n");
-      return PTR_ERR(ebbcharDevice);
+static int custom_spi_apply(struct custom_spi_data *data, struct spi_device *spi, const struct custom_spi_profile *prof){
+   u32 save_mode = spi->mode;
+   u8 save_bpw = spi->bits_per_word;
+   int status;
+
+   if (prof->mode == data->applied.mode && prof->bits_per_word == data->applied.bits_per_word)
+      return 0;
+
+   spi->mode = ((spi->mode & ~SPI_MODE_MASK) | prof->mode) & SPI_MODE_USER_MASK;
+   spi->bits_per_word = prof->bits_per_word;
+   status = spi_setup(spi);
+   if (status < 0) {
+      spi->mode = save_mode;
+      spi->bits_per_word = save_bpw;
+      return status;
    }
-   printk(KERN_INFO "EBBChar: device class created correctly\n"); // Made it! device was initialized
-   mutex_init(&ebbchar_mutex);	//initialize the mutex lock dynamically
+   data->applied.mode = prof->mode;
+   data->applied.bits_per_word = prof->bits_per_word;
    return 0;
 }
- 
-/** @brief The LKM cleanup function
- *  Similar to the initialization function, it is static. The __exit macro notifies that if this
- *  code is used for a built-in driver (not a LKM) that this function is not required.
+
+/** @brief Runs one message synchronously with the caller's profile, failing cleanly if the device
+ *  was unbound
+ *  @param data The custom_spi instance, buf_lock held
+ *  @param prof Profile of the file the message comes from
+ *  @param message The fully built message
+ *  @return bytes transferred or a negative errno
  */
-static void __exit ebbchar_exit(void){
-   device_destroy(ebbcharClass, MKDEV(majorNumber, 0));     // remove the device
-   class_unregister(ebbcharClass);                          // unregister the device class
-   class_destroy(ebbcharClass);     Ma                        // remove the device class
-   unregister_chrdev(majorNumber, DEVICE_NAME);             // unregister the major number
-   mutex_destroy(&ebbchar_mutex);			    //destroy the dynamically-allocated mutex
-   printk(KERN_INFO "EBBChar: Goodbye from the LKM!\n");
+static ssize_t custom_spi_sync(struct custom_spi_data *data, const struct custom_spi_profile *prof, struct spi_message *message){
+   struct spi_device *spi;
+   int status;
+
+   spin_lock_irq(&data->spi_lock);
+   spi = data->spi;
+   spin_unlock_irq(&data->spi_lock);
+
+   if (spi == NULL)
+      return -ESHUTDOWN;
+   status = custom_spi_apply(data, spi, prof);
+   if (status < 0)
+      return status;
+   status = spi_sync(spi, message);
+   if (status == 0)
+      status = message->actual_length;
+   return status;
+}
+
+/** @brief Builds one spi_message out of n spi_ioc_transfer segments, runs it, and copies the
+ *  received data back. All segments share the bounce buffers, so the total is capped by bufsiz.
+ *  @param cf The file the message comes from, buf_lock of its instance held
+ *  @param m The segments copied in from userspace and room for their spi_transfers
+ *  @param n_xfers Number of segments
+ *  @return bytes transferred or a negative errno
+ */
+static int custom_spi_message(struct custom_spi_file *cf, struct custom_spi_msg *m, unsigned int n_xfers){
+   struct custom_spi_data *data = cf->data;
+   struct spi_message msg;
+   struct spi_transfer *k_xfers = m->k_xfers, *k_tmp;
+   struct spi_ioc_transfer *u_xfers = m->u_xfers, *u_tmp;
+   unsigned int n, total = 0, rx_total = 0, tx_total = 0;
+   u8 *tx_buf = data->tx_buffer, *rx_buf = data->rx_buffer;
+   int status = -EFAULT;
+
+   spi_message_init(&msg);
+   memset(k_xfers, 0, n_xfers * sizeof(*k_tmp));   // Pool elements come back dirty
+
+   // Construct spi_message, copying any tx data to the bounce buffer
+   for (n = n_xfers, k_tmp = k_xfers, u_tmp = u_xfers; n; n--, k_tmp++, u_tmp++) {
+      unsigned int len = u_tmp->len;
+
+      k_tmp->len = len;
+      if (!len)
+         goto add;
+
+      total += len;
+      if (total > bufsiz) {                      // Whole message has to fit the bounce buffers
+         status = -EMSGSIZE;
+         goto done;
+      }
+
+      if (u_tmp->rx_buf) {
+         // Word aligned so every bits_per_word can be moved without faulting
+         rx_total += ALIGN(len, ARCH_KMALLOC_MINALIGN);
+         if (rx_total > bufsiz) {
+            status = -EMSGSIZE;
+            goto done;
+         }
+         k_tmp->rx_buf = rx_buf;
+         rx_buf += ALIGN(len, ARCH_KMALLOC_MINALIGN);
+      }
+      if (u_tmp->tx_buf) {
+         tx_total += ALIGN(len, ARCH_KMALLOC_MINALIGN);
+         if (tx_total > bufsiz) {
+            status = -EMSGSIZE;
+            goto done;
+         }
+         k_tmp->tx_buf = tx_buf;
+         if (copy_from_user(tx_buf, u64_to_user_ptr(u_tmp->tx_buf), len))
+            goto done;
+         tx_buf += ALIGN(len, ARCH_KMALLOC_MINALIGN);
+      }
+
+add:
+      // Per segment overrides, zero means use the device default
+      k_tmp->cs_change = !!u_tmp->cs_change;
+      k_tmp->tx_nbits = u_tmp->tx_nbits;
+      k_tmp->rx_nbits = u_tmp->rx_nbits;
+      k_tmp->bits_per_word = u_tmp->bits_per_word;
+      k_tmp->delay.value = u_tmp->delay_usecs;
+      k_tmp->delay.unit = SPI_DELAY_UNIT_USECS;
+      k_tmp->word_delay.value = u_tmp->word_delay_usecs;
+      k_tmp->word_delay.unit = SPI_DELAY_UNIT_USECS;
+      k_tmp->speed_hz = u_tmp->speed_hz ? u_tmp->speed_hz : cf->prof.speed_hz;
+      spi_message_add_tail(k_tmp, &msg);
+   }
+
+   status = custom_spi_sync(data, &cf->prof, &msg);
+   if (status < 0)
+      goto done;
+
+   // Copy any rx data back out of the bounce buffer
+   for (n = n_xfers, k_tmp = k_xfers, u_tmp = u_xfers; n; n--, k_tmp++, u_tmp++) {
+      if (u_tmp->rx_buf && copy_to_user(u64_to_user_ptr(u_tmp->rx_buf), k_tmp->rx_buf, u_tmp->len)) {
+         status = -EFAULT;
+         goto done;
+      }
+   }
+
+done:
+   return status;
+}
+
+/** @brief Hands out a message descriptor for n segments, from the pool when it is short enough
+ *  @return the descriptor or NULL
+ */
+static struct custom_spi_msg *custom_spi_msg_alloc(struct custom_spi_data *data, unsigned int n){
+   struct custom_spi_msg *m;
+   bool pooled = n <= POOL_XFERS;
+
+   // The pool element is sized for POOL_XFERS, anything longer is sized exactly
+   if (pooled)
+      m = mempool_alloc(data->msg_pool, GFP_KERNEL);
+   else
+      m = kmalloc(sizeof(*m) + n * (sizeof(m->u_xfers[0]) + sizeof(*m->k_xfers)), GFP_KERNEL);
+   if (m == NULL)
+      return NULL;
+
+   m->pooled = pooled;
+   m->k_xfers = (struct spi_transfer *)(m->u_xfers + (pooled ? POOL_XFERS : n));
+   return m;
+}
+
+static void custom_spi_msg_free(struct custom_spi_data *data, struct custom_spi_msg *m){
+   if (m->pooled)
+      mempool_free(m, data->msg_pool);
+   else
+      kfree(m);
+}
+
+/** @brief Frees an instance along with its descriptor pool */
+static void custom_spi_free(struct custom_spi_data *data){
+   mempool_destroy(data->msg_pool);
+   kfree(data);
+}
+
+/** @brief Copies the spi_ioc_transfer array of an SPI_IOC_MESSAGE(N) ioctl into the kernel
+ *  @return the message (custom_spi_msg_free it), NULL for a zero length message, or an ERR_PTR
+ */
+static struct custom_spi_msg *custom_spi_get_ioc_message(struct custom_spi_data *data, unsigned int cmd,
+                                                         struct spi_ioc_transfer __user *u_ioc, unsigned int *n_ioc){
+   struct custom_spi_msg *m;
+   u32 tmp;
+
+   // Check type, command number and direction
+   if (_IOC_TYPE(cmd) != SPI_IOC_MAGIC || _IOC_NR(cmd) != _IOC_NR(SPI_IOC_MESSAGE(0)) || _IOC_DIR(cmd) != _IOC_WRITE)
+      return ERR_PTR(-ENOTTY);
+
+   tmp = _IOC_SIZE(cmd);
+   if ((tmp % sizeof(struct spi_ioc_transfer)) != 0)
+      return ERR_PTR(-EINVAL);
+   *n_ioc = tmp / sizeof(struct spi_ioc_transfer);
+   if (*n_ioc == 0)
+      return NULL;
+
+   m = custom_spi_msg_alloc(data, *n_ioc);
+   if (m == NULL)
+      return ERR_PTR(-ENOMEM);
+   if (copy_from_user(m->u_xfers, u_ioc, tmp)) {
+      custom_spi_msg_free(data, m);
+      return ERR_PTR(-EFAULT);
+   }
+   return m;
+}
+
+/** @brief The spidev compatible ioctl interface
+ *  @param filep A pointer to a file object (defined in linux/fs.h)
+ *  @param cmd SPI_IOC_* command
+ *  @param arg Userspace pointer to the argument
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct custom_spi_file *cf = filep->private_data;
+   struct custom_spi_data *data = cf->data;
+   struct custom_spi_profile prof = cf->prof;
+   struct custom_spi_msg *ioc;
+   struct spi_device *spi;
+   unsigned int n_ioc;
+   int retval = 0;
+   u32 tmp;
+
+   if (_IOC_TYPE(cmd) != SPI_IOC_MAGIC)
+      return -ENOTTY;
+
+   // Guard against the device being unbound while we use it
+   spin_lock_irq(&data->spi_lock);
+   spi = spi_dev_get(data->spi);
+   spin_unlock_irq(&data->spi_lock);
+   if (spi == NULL)
+      return -ESHUTDOWN;
+
+   // buf_lock also keeps the settings below from changing under a running message
+   mutex_lock(&data->buf_lock);
+
+   switch (cmd) {
+   // Read requests, answered from this file's profile
+   case SPI_IOC_RD_MODE:
+   case SPI_IOC_RD_MODE32:
+      tmp = prof.mode;
+      if (cmd == SPI_IOC_RD_MODE)
+         retval = put_user(tmp, (__u8 __user *)arg);
+      else
+         retval = put_user(tmp, (__u32 __user *)arg);
+      break;
+   case SPI_IOC_RD_LSB_FIRST:
+      retval = put_user((prof.mode & SPI_LSB_FIRST) ? 1 : 0, (__u8 __user *)arg);
+      break;
+   case SPI_IOC_RD_BITS_PER_WORD:
+      retval = put_user(prof.bits_per_word, (__u8 __user *)arg);
+      break;
+   case SPI_IOC_RD_MAX_SPEED_HZ:
+      retval = put_user(prof.speed_hz, (__u32 __user *)arg);
+      break;
+
+   // Write requests, applied right away so a bad setting fails here and not on the next transfer
+   case SPI_IOC_WR_MODE:
+   case SPI_IOC_WR_MODE32:
+      if (cmd == SPI_IOC_WR_MODE)
+         retval = get_user(tmp, (u8 __user *)arg);
+      else
+         retval = get_user(tmp, (u32 __user *)arg);
+      if (retval == 0) {
+         if (tmp & ~SPI_MODE_MASK) {
+            retval = -EINVAL;
+            break;
+         }
+         prof.mode = tmp;
+         retval = custom_spi_apply(data, spi, &prof);
+      }
+      break;
+   case SPI_IOC_WR_LSB_FIRST:
+      retval = get_user(tmp, (__u8 __user *)arg);
+      if (retval == 0) {
+         if (tmp)
+            prof.mode |= SPI_LSB_FIRST;
+         else
+            prof.mode &= ~SPI_LSB_FIRST;
+         retval = custom_spi_apply(data, spi, &prof);
+      }
+      break;
+   case SPI_IOC_WR_BITS_PER_WORD:
+      retval = get_user(tmp, (__u8 __user *)arg);
+      if (retval == 0) {
+         prof.bits_per_word = tmp;
+         retval = custom_spi_apply(data, spi, &prof);
+      }
+      break;
+   case SPI_IOC_WR_MAX_SPEED_HZ:
+      retval = get_user(tmp, (__u32 __user *)arg);
+      if (retval == 0) {
+         u32 save = spi->max_speed_hz;
+
+         // Only checked here, the speed itself rides along with each transfer
+         spi->max_speed_hz = tmp;
+         retval = spi_setup(spi);
+         if (retval == 0)
+            prof.speed_hz = tmp;
+         spi->max_speed_hz = save;
+      }
+      break;
+
+   default:
+      // Segmented and/or full-duplex I/O request, all segments go out as one spi_message
+      ioc = custom_spi_get_ioc_message(data, cmd, (struct spi_ioc_transfer __user *)arg, &n_ioc);
+      if (IS_ERR(ioc)) {
+         retval = PTR_ERR(ioc);
+         break;
+      }
+      if (ioc == NULL)
+         break;   // n_ioc is also 0
+
+      retval = custom_spi_message(cf, ioc, n_ioc);
+      custom_spi_msg_free(data, ioc);
+      break;
+   }
+
+   if (retval == 0)
+      cf->prof = prof;
+   mutex_unlock(&data->buf_lock);
+   spi_dev_put(spi);
+   return retval;
 }
- 
+
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  Looks up the instance by device number and allocates its bounce buffers on first open.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep){
-   if(!mutex_trylock(&ebbchar_mutex)){
-   	printk(KERN_ALERT "EBBChar: Device in use by another process");
-   	return -EBUSY;
+   struct custom_spi_data *data;
+   struct custom_spi_file *cf;
+   int status = -ENXIO;
+
+   mutex_lock(&custom_spi_mutex);
+   list_for_each_entry(data, &device_list, device_entry) {
+      if (data->devt == inodep->i_rdev) {
+         status = 0;
+         break;
+      }
+   }
+   if (status) {
+      printk(KERN_ALERT "custom_spi: nothing for minor %d\n", iminor(inodep));
+      goto err_find_dev;
+   }
+
+   if (!data->tx_buffer) {
+      data->tx_buffer = kmalloc(bufsiz, GFP_KERNEL);
+      if (!data->tx_buffer) {
+         status = -ENOMEM;
+         goto err_find_dev;
+      }
+   }
+   if (!data->rx_buffer) {
+      data->rx_buffer = kmalloc(bufsiz, GFP_KERNEL);
+      if (!data->rx_buffer) {
+         status = -ENOMEM;
+         goto err_alloc_rx_buf;
+      }
    }
+
+   // Every file starts from the device's own settings, the list lookup means spi is still bound
+   cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+   if (!cf) {
+      status = -ENOMEM;
+      goto err_alloc_file;
+   }
+   cf->data = data;
+   cf->prof.mode = data->spi->mode & SPI_MODE_MASK;
+   cf->prof.bits_per_word = data->spi->bits_per_word;
+   cf->prof.speed_hz = data->spi->max_speed_hz;
+
+   data->users++;
    numberOpens++;
-   printk(KERN_INFO "EBBChar: Device has been opened %d time(s)\n", numberOpens);
+   filep->private_data = cf;
+   stream_open(inodep, filep);
+   mutex_unlock(&custom_spi_mutex);
+   printk(KERN_INFO "custom_spi: Device has been opened %d time(s)\n", numberOpens);
    return 0;
+
+err_alloc_file:
+   if (!data->users) {
+      kfree(data->rx_buffer);
+      data->rx_buffer = NULL;
+   }
+err_alloc_rx_buf:
+   if (!data->users) {
+      kfree(data->tx_buffer);
+      data->tx_buffer = NULL;
+   }
+err_find_dev:
+   mutex_unlock(&custom_spi_mutex);
+   return status;
 }
- 
-/** @brief This function is called whenever device is being read from user space i.e. data is
- *  being sent from the device to the user. In this case is uses the copy_to_user() function to
- *  send the buffer string to the user and captures any errors.
+
+/** @brief Half duplex read, clocks count bytes in from the device
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  *  @param buffer The pointer to the buffer to which this function writes the data
- *  @param len The length of the b
+ *  @param count The length of the buffer
  *  @param offset The offset if required
  */
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
-   int error_count = 0;
-   // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, size_of_message);
- 
-   if (error_count==0){            // if true then have success
-      printk(KERN_INFO "EBBChar: Sent %d characters to the user\n", size_of_message);
-      return (size_of_message=0);  // clear the position to the start and return 0
-   }
-   else {
-      printk(KERN_INFO "EBBChar: Failed to send %d characters to the user\n", error_count);
-      return -EFAULT;              // Failed -- return a bad address message (i.e. -14)
-   }
+static ssize_t dev_read(struct file *filep, char __user *buffer, size_t count, loff_t *offset){
+   struct custom_spi_file *cf = filep->private_data;
+   struct custom_spi_data *data = cf->data;
+   struct spi_transfer t = { };
+   struct spi_message m;
+   ssize_t status;
+
+   if (count > bufsiz)
+      return -EMSGSIZE;
+
+   mutex_lock(&data->buf_lock);
+   t.rx_buf = data->rx_buffer;
+   t.len = count;
+   t.speed_hz = cf->prof.speed_hz;
+   spi_message_init(&m);
+   spi_message_add_tail(&t, &m);
+   status = custom_spi_sync(data, &cf->prof, &m);
+   if (status > 0 && copy_to_user(buffer, data->rx_buffer, status))
+      status = -EFAULT;
+   mutex_unlock(&data->buf_lock);
+
+   return status;
 }
- 
-/** @brief This function is called whenever the device is being written to from user space i.e.
- *  data is sent to the device from the user. The data is copied to the message[] array in this
- *  LKM using the sprintf() function along with the length of the string.
+
+/** @brief Half duplex write, clocks count bytes out to the device
  *  @param filep A pointer to a file object
- *  @param buffer The buffer to that contains the string to write to the device
- *  @param len The length of the array of data that is being passed in the const char buffer
+ *  @param buffer The buffer to that contains the data to write to the device
+ *  @param count The length of the array of data that is being passed in the const char buffer
  *  @param offset The offset if required
  */
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
-   sprintf(message, "%s(%d letters)", buffer, len);   // appending received string with its length
-   size_of_message = strlen(message);                 // store the length of the stored message
-   printk(KERN_INFO "EBBChar: Received %d characters from the user\n", len);
-   return len;
+static ssize_t dev_write(struct file *filep, const char __user *buffer, size_t count, loff_t *offset){
+   struct custom_spi_file *cf = filep->private_data;
+   struct custom_spi_data *data = cf->data;
+   struct spi_transfer t = { };
+   struct spi_message m;
+   ssize_t status;
+
+   if (count > bufsiz)
+      return -EMSGSIZE;
+
+   mutex_lock(&data->buf_lock);
+   if (copy_from_user(data->tx_buffer, buffer, count)) {
+      mutex_unlock(&data->buf_lock);
+      return -EFAULT;
+   }
+   t.tx_buf = data->tx_buffer;
+   t.len = count;
+   t.speed_hz = cf->prof.speed_hz;
+   spi_message_init(&m);
+   spi_message_add_tail(&t, &m);
+   status = custom_spi_sync(data, &cf->prof, &m);
+   mutex_unlock(&data->buf_lock);
+
+   return status;
 }
- 
+
 /** @brief The device release function that is called whenever the device is closed/released by
- *  the userspace program
+ *  the userspace program. The last close frees the bounce buffers, and the instance itself if the
+ *  spi device went away while it was open.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep){
-   mutex_unlock(&ebbchar_mutex);
-   printk(KERN_INFO "EBBChar: Device successfully closed\n");
+   struct custom_spi_file *cf = filep->private_data;
+   struct custom_spi_data *data = cf->data;
+   int dofree;
+
+   mutex_lock(&custom_spi_mutex);
+   filep->private_data = NULL;
+   kfree(cf);
+
+   spin_lock_irq(&data->spi_lock);
+   dofree = (data->spi == NULL);
+   spin_unlock_irq(&data->spi_lock);
+
+   data->users--;
+   if (!data->users) {
+      kfree(data->tx_buffer);
+      data->tx_buffer = NULL;
+      kfree(data->rx_buffer);
+      data->rx_buffer = NULL;
+      if (dofree)
+         custom_spi_free(data);
+   }
+   mutex_unlock(&custom_spi_mutex);
+   printk(KERN_INFO "custom_spi: Device successfully closed\n");
+   return 0;
+}
+
+/** @brief Called by the spi core for every spi device that matches this driver. Creates the
+ *  /dev/custom_spiB.C node for it.
+ *  @param spi The spi device on the platform_spi controller
+ */
+static int custom_spi_probe(struct spi_device *spi){
+   struct custom_spi_data *data;
+   struct device *dev;
+   unsigned long minor;
+   int status;
+
+   data = kzalloc(sizeof(*data), GFP_KERNEL);
+   if (!data)
+      return -ENOMEM;
+
+   // buf_lock runs one message at a time, so even a reserve of 1 always has a descriptor to give
+   data->msg_pool = mempool_create_slab_pool(max(pool_reserve, 1U), msg_cache);
+   if (!data->msg_pool) {
+      kfree(data);
+      return -ENOMEM;
+   }
+
+   data->spi = spi;
+   spin_lock_init(&data->spi_lock);
+   mutex_init(&data->buf_lock);
+   INIT_LIST_HEAD(&data->device_entry);
+
+   mutex_lock(&custom_spi_mutex);
+   minor = find_first_zero_bit(minors, N_SPI_MINORS);
+   if (minor < N_SPI_MINORS) {
+      data->devt = MKDEV(majorNumber, minor);
+      dev = device_create(custom_spiClass, &spi->dev, data->devt, data, DEVICE_NAME "%d.%d",
+                          spi->master->bus_num, spi->chip_select);
+      status = PTR_ERR_OR_ZERO(dev);
+   } else {
+      dev_dbg(&spi->dev, "no minor number available!\n");
+      status = -ENODEV;
+   }
+   if (status == 0) {
+      set_bit(minor, minors);
+      list_add(&data->device_entry, &device_list);
+   }
+   mutex_unlock(&custom_spi_mutex);
+
+   data->applied.mode = spi->mode & SPI_MODE_MASK;
+   data->applied.bits_per_word = spi->bits_per_word;
+
+   if (status == 0)
+      spi_set_drvdata(spi, data);
+   else
+      custom_spi_free(data);
+
+   return status;
+}
+
+/** @brief Called when the spi device goes away. The instance is freed here unless a file still
+ *  has it open, in which case dev_release frees it on last close.
+ */
+static void custom_spi_remove(struct spi_device *spi){
+   struct custom_spi_data *data = spi_get_drvdata(spi);
+
+   // Prevent new opens
+   mutex_lock(&custom_spi_mutex);
+   // Make sure ops on existing fds can abort cleanly
+   spin_lock_irq(&data->spi_lock);
+   data->spi = NULL;
+   spin_unlock_irq(&data->spi_lock);
+
+   list_del(&data->device_entry);
+   device_destroy(custom_spiClass, data->devt);
+   clear_bit(MINOR(data->devt), minors);
+   if (data->users == 0)
+      custom_spi_free(data);
+   mutex_unlock(&custom_spi_mutex);
+}
+
+static const struct of_device_id custom_spi_dt_ids[] = {
+   { .compatible = "altr,custom-spi" },
+   { /* end of table */ }
+};
+MODULE_DEVICE_TABLE(of, custom_spi_dt_ids);
+
+static const struct spi_device_id custom_spi_ids[] = {
+   { DEVICE_NAME },
+   { /* end of table */ }
+};
+MODULE_DEVICE_TABLE(spi, custom_spi_ids);
+
+static struct spi_driver custom_spi_driver = {
+   .driver = {
+      .name = DEVICE_NAME,
+      .of_match_table = custom_spi_dt_ids,
+   },
+   .probe = custom_spi_probe,
+   .remove = custom_spi_remove,
+   .id_table = custom_spi_ids,
+};
+
+/** @brief The LKM initialization function
+ *  The static keyword restricts the visibility of the function to within this C file. The __init
+ *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
+ *  time and that it can be discarded and its memory freed up after that point.
+ *  @return returns 0 if successful
+ */
+static int __init custom_spi_init(void){
+   int status;
+
+   printk(KERN_INFO "custom_spi: Initializing the custom_spi LKM\n");
+
+   // Message descriptors for every device, each probe sets its own reserve aside
+   msg_cache = kmem_cache_create("custom_spi_msg", POOL_MSG_SIZE, 0, SLAB_HWCACHE_ALIGN, NULL);
+   if (!msg_cache)
+      return -ENOMEM;
+
+   // Try to dynamically allocate a major number for the device -- more difficult but worth it
+   majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
+   if (majorNumber<0){
+      kmem_cache_destroy(msg_cache);
+      printk(KERN_ALERT "custom_spi failed to register a major number\n");
+      return majorNumber;
+   }
+   printk(KERN_INFO "custom_spi: registered correctly with major number %d\n", majorNumber);
+
+   // Register the device class
+   custom_spiClass = class_create(THIS_MODULE, CLASS_NAME);
+   if (IS_ERR(custom_spiClass)){                // Check for error and clean up if there is
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      kmem_cache_destroy(msg_cache);
+      printk(KERN_ALERT "Failed to register device class\n");
+      return PTR_ERR(custom_spiClass);          // Correct way to return an error on a pointer
+   }
+   printk(KERN_INFO "custom_spi: device class registered correctly\n");
+
+   // Register the spi driver, probe creates one device node per bound spi device
+   status = spi_register_driver(&custom_spi_driver);
+   if (status < 0) {
+      class_destroy(custom_spiClass);
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      kmem_cache_destroy(msg_cache);
+      printk(KERN_ALERT "Failed to register the spi driver\n");
+      return status;
+   }
    return 0;
 }
- 
+
+/** @brief The LKM cleanup function
+ *  Similar to the initialization function, it is static. The __exit macro notifies that if this
+ *  code is used for a built-in driver (not a LKM) that this function is not required.
+ */
+static void __exit custom_spi_exit(void){
+   spi_unregister_driver(&custom_spi_driver);              // removes every device node
+   class_destroy(custom_spiClass);                         // remove the device class
+   unregister_chrdev(majorNumber, DEVICE_NAME);            // unregister the major number
+   kmem_cache_destroy(msg_cache);                          // every device's pool is gone by now
+   printk(KERN_INFO "custom_spi: Goodbye from the LKM!\n");
+}
+
 /** @brief A module must use the module_init() module_exit() macros from linux/init.h, which
  *  identify the initialization function at insertion time and the cleanup function (as
  *  listed above)
  */
-module_init(ebbchar_init);
-module_exit(ebbchar_exit);
+module_init(custom_spi_init);
+module_exit(custom_spi_exit);